@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include "client_table.h"
+
+#define INITIAL_SLOTS 1024
+
+static inline uint64_t make_key(uint32_t addr, uint16_t port) {
+    return 1ULL << 48 | (uint64_t) addr << 16 | port;
+}
+
+static inline size_t hash_key(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (size_t) k;
+}
+
+static struct client_entry *find(const struct client_table *t, uint64_t key) {
+    for (size_t i = hash_key(key) & t->mask;; i = (i + 1) & t->mask) {
+        if (t->slots[i].key == key) return &t->slots[i];
+        if (t->slots[i].key == 0) return NULL;
+    }
+}
+
+static struct client_entry *insert_slot(struct client_entry *slots, size_t mask, uint64_t key) {
+    size_t i = hash_key(key) & mask;
+    while (slots[i].key) i = (i + 1) & mask;
+    return &slots[i];
+}
+
+static int grow(struct client_table *t) {
+    size_t nslots = (t->mask + 1) * 2;
+    struct client_entry *slots = calloc(nslots, sizeof(*slots));
+    if (!slots) return -1;
+    for (size_t i = 0; i <= t->mask; i++) {
+        if (t->slots[i].key) *insert_slot(slots, nslots - 1, t->slots[i].key) = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->mask = nslots - 1;
+    return 0;
+}
+
+/* Backward-shift deletion: pull later members of the probe run into the hole, so lookups need no tombstones. */
+static void erase(struct client_table *t, struct client_entry *e) {
+    size_t hole = (size_t) (e - t->slots);
+    for (size_t i = (hole + 1) & t->mask; t->slots[i].key; i = (i + 1) & t->mask) {
+        size_t home = hash_key(t->slots[i].key) & t->mask;
+        /* Entry i may move to the hole only if the hole lies on its probe path: home .. i, cyclically */
+        if (((i - home) & t->mask) >= ((i - hole) & t->mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].key = 0;
+    t->count--;
+}
+
+static int schedule(struct client_table *t, uint64_t key, time_t due) {
+    struct client_timer_slot *s = &t->wheel[(size_t) due & t->wheel_mask];
+    if (s->len == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 16;
+        uint64_t *keys = realloc(s->keys, cap * sizeof(*keys));
+        if (!keys) return -1;
+        s->keys = keys;
+        s->cap = cap;
+    }
+    s->keys[s->len++] = key;
+    return 0;
+}
+
+int client_table_init(struct client_table *t, time_t idle, time_t now) {
+    memset(t, 0, sizeof(*t));
+    t->idle = idle;
+    t->wheel_now = now;
+    size_t nwheel = 1;
+    while (nwheel < (size_t) idle + 2) nwheel *= 2;     /* a deadline is never a full turn away */
+    t->wheel = calloc(nwheel, sizeof(*t->wheel));
+    t->slots = calloc(INITIAL_SLOTS, sizeof(*t->slots));
+    if (!t->wheel || !t->slots) {
+        free(t->wheel);
+        free(t->slots);
+        return -1;
+    }
+    t->wheel_mask = nwheel - 1;
+    t->mask = INITIAL_SLOTS - 1;
+    return 0;
+}
+
+struct client_entry *client_table_get(struct client_table *t, uint32_t addr, uint16_t port, time_t now) {
+    uint64_t key = make_key(addr, port);
+    struct client_entry *e = find(t, key);
+    if (e) return e;
+    if ((t->count + 1) * 2 > t->mask + 1 && grow(t) < 0) return NULL;
+    if (schedule(t, key, now + t->idle + 1) < 0) return NULL;
+    e = insert_slot(t->slots, t->mask, key);
+    e->key = key;
+    e->max_seq = 0;
+    e->last_update = now;
+    t->count++;
+    return e;
+}
+
+void client_table_expire(struct client_table *t, time_t now) {
+    /* After a long quiet spell one turn of the wheel visits every client */
+    if (now - t->wheel_now > (time_t) t->wheel_mask + 1) t->wheel_now = now - (time_t) t->wheel_mask - 1;
+    for (; t->wheel_now <= now; t->wheel_now++) {
+        /* Detached first: while catching up, a client can be filed right back into this slot */
+        struct client_timer_slot *s = &t->wheel[(size_t) t->wheel_now & t->wheel_mask];
+        struct client_timer_slot due = *s;
+        memset(s, 0, sizeof(*s));
+        for (size_t i = 0; i < due.len; i++) {
+            struct client_entry *e = find(t, due.keys[i]);
+            if (!e) continue;
+            if (now - e->last_update > t->idle) {
+                erase(t, e);
+                t->expired++;
+            } else if (schedule(t, e->key, e->last_update + t->idle + 1) < 0) {
+                erase(t, e);    /* out of memory: forgetting a client early only resets its max_seq */
+            }
+        }
+        if (s->keys) {
+            free(due.keys);
+        } else {
+            s->keys = due.keys;
+            s->cap = due.cap;
+        }
+    }
+}
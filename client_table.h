@@ -0,0 +1,56 @@
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-client sequence tracking for udp_server, keyed on (addr, port).
+ *
+ * An open-addressing table with linear probing finds a client in O(1) and
+ * doubles when half full. Idle clients leave through a hashed timing wheel
+ * with one slot per second: every client sits in the slot of the second
+ * it would expire in, and advancing the wheel only looks at the slots that
+ * came due. A client that was active since it was filed is simply filed
+ * again for its new deadline, so the packet path never touches the wheel.
+ *
+ * Not locked: every receive thread owns a separate table.
+ */
+
+struct client_entry {
+    uint64_t key;               /* 0 marks a free slot */
+    uint32_t max_seq;
+    time_t last_update;
+};
+
+struct client_timer_slot {
+    uint64_t *keys;
+    size_t len, cap;
+};
+
+struct client_table {
+    struct client_entry *slots;
+    size_t mask;                /* number of slots - 1 */
+    size_t count;
+    time_t idle;                /* seconds without progress after which a client is forgotten */
+    struct client_timer_slot *wheel;
+    size_t wheel_mask;
+    time_t wheel_now;           /* every second before this one has been processed */
+    uint64_t expired;
+};
+
+/* Returns -1 if out of memory. */
+int client_table_init(struct client_table *t, time_t idle, time_t now);
+
+/*
+ * The entry for (addr, port), both in network byte order, created with
+ * max_seq 0 if there was none. NULL if out of memory. The pointer is only
+ * good until the next call.
+ */
+struct client_entry *client_table_get(struct client_table *t, uint32_t addr, uint16_t port, time_t now);
+
+/* Forget every client that has been idle for longer than t->idle by now. */
+void client_table_expire(struct client_table *t, time_t now);
+
+#endif
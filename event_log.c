@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include "event_log.h"
+
+struct event_logger {
+    struct event_ring *rings;
+    int n;
+    FILE *out;
+    int binary;
+    struct event_bell bell;
+};
+
+static void write_event(const struct event_logger *l, const struct ooo_event *e) {
+    if (l->binary) {
+        struct ooo_event le = *e;
+        le.worker = htole16(e->worker);
+        le.seq = htole32(e->seq);
+        le.max_seq = htole32(e->max_seq);
+        fwrite(&le, sizeof(le), 1, l->out);
+        return;
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &e->addr, ip, sizeof(ip));
+    fprintf(l->out, "%s:%u %u %u\n", ip, ntohs(e->port), e->seq, e->max_seq);
+}
+
+static int rings_empty(const struct event_logger *l) {
+    for (int i = 0; i < l->n; i++) {
+        const struct event_ring *r = &l->rings[i];
+        if (__atomic_load_n(&r->head, __ATOMIC_RELAXED) != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return 0;
+    }
+    return 1;
+}
+
+/* Block until a worker rings, unless a report slipped in before the flag was seen. */
+static void wait_for_events(struct event_logger *l) {
+    __atomic_store_n(&l->bell.sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (rings_empty(l)) {
+        uint64_t v;
+        while (read(l->bell.fd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+    }
+    __atomic_store_n(&l->bell.sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void *event_log_main(void *arg) {
+    struct event_logger *l = arg;
+    uint64_t reported = 0;
+    time_t last_report = 0;
+    for (;;) {
+        int busy = 0;
+        uint64_t dropped = 0;
+        for (int i = 0; i < l->n; i++) {
+            struct event_ring *r = &l->rings[i];
+            uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+            uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            if (head != tail) busy = 1;
+            for (; head != tail; head++) write_event(l, &r->slots[head & (EVENT_RING_SIZE - 1)]);
+            /* Hand the slots back only once they are formatted */
+            __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+            dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        }
+        if (busy) fflush(l->out);
+        /* At most once a second while busy, so the warning cannot become the bottleneck itself */
+        if (dropped > reported && (!busy || time(NULL) != last_report)) {
+            fprintf(stderr, "out-of-order log: %llu reports dropped, output too slow\n",
+                    (unsigned long long) (dropped - reported));
+            reported = dropped;
+            last_report = time(NULL);
+        }
+        if (!busy) wait_for_events(l);
+    }
+    return NULL;
+}
+
+void event_log_start(struct event_ring *rings, int n, FILE *out, int binary) {
+    struct event_logger *l = calloc(1, sizeof(*l));
+    if (!l) {
+        perror("calloc");
+        exit(1);
+    }
+    l->rings = rings;
+    l->n = n;
+    l->out = out;
+    l->binary = binary;
+    l->bell.fd = eventfd(0, EFD_CLOEXEC);
+    if (l->bell.fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) rings[i].bell = &l->bell;
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, event_log_main, l);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+    pthread_detach(thread);
+}
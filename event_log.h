@@ -0,0 +1,74 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * Out-of-order reports of udp_server, written off the packet path. Every
+ * worker owns a single-producer single-consumer ring of fixed-size records
+ * and one logger thread drains them all, formats the records and writes
+ * them out. A worker never waits for the output: when its ring is full the
+ * report is dropped and counted, and the logger says so on stderr.
+ *
+ * With nothing to write the logger blocks on an eventfd. It raises a flag
+ * first, as the shared-memory rings of tcp_server do, and a worker rings
+ * the eventfd only when it publishes a report while the flag is up; a busy
+ * logger costs the workers no system call.
+ */
+
+#define EVENT_RING_SIZE 4096    /* records per worker; power of two */
+
+/* Also the binary output format: addr and port as on the wire, the rest little-endian. */
+struct __attribute__((__packed__)) ooo_event {
+    uint32_t addr;              /* network order */
+    uint16_t port;              /* network order */
+    uint16_t worker;
+    uint32_t seq;
+    uint32_t max_seq;
+};
+
+/* Where the logger sleeps; shared by every ring. */
+struct event_bell {
+    _Alignas(64) uint32_t sleeping;
+    int fd;                         /* eventfd */
+};
+
+struct event_ring {
+    _Alignas(64) uint32_t head;     /* consumer position, free running */
+    _Alignas(64) uint32_t tail;     /* producer position, free running */
+    uint64_t dropped;               /* written by the producer only */
+    struct event_bell *bell;        /* set by event_log_start */
+    struct ooo_event slots[EVENT_RING_SIZE];
+};
+
+/* Producer side. Returns -1, and counts the loss, if the ring is full. */
+static inline int event_ring_push(struct event_ring *r, const struct ooo_event *e) {
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == EVENT_RING_SIZE) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    r->slots[tail & (EVENT_RING_SIZE - 1)] = *e;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    /* Pairs with the logger's fence between raising the flag and its last look at the rings */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    struct event_bell *b = r->bell;
+    if (__atomic_load_n(&b->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&b->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(b->fd, &one, sizeof(one)) < 0) {
+            /* EAGAIN: the counter is already nonzero, so the logger wakes anyway */
+        }
+    }
+    return 0;
+}
+
+/*
+ * Drain the n rings from a thread of its own: one "ip:port seq max_seq"
+ * line per report on out or, with binary, the records themselves. Nothing
+ * may be pushed before this returns.
+ */
+void event_log_start(struct event_ring *rings, int n, FILE *out, int binary);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hash_cache.h"
+
+int hash_cache_init(struct hash_cache *hc, size_t budget) {
+    memset(hc, 0, sizeof(*hc));
+    size_t nsets = 1;
+    while (nsets * 2 * sizeof(struct hash_cache_set) <= budget) nsets *= 2;
+    hc->sets = calloc(nsets, sizeof(*hc->sets));
+    if (!hc->sets) return -1;
+    hc->mask = nsets - 1;
+    return 0;
+}
+
+void hash_cache_free(struct hash_cache *hc) {
+    free(hc->sets);
+    hc->sets = NULL;
+}
+
+size_t hash_cache_capacity(const struct hash_cache *hc) {
+    return (hc->mask + 1) * HASH_CACHE_WAYS;
+}
+
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ULL;
+    x ^= x >> 32;
+    return x;
+}
+
+/* Eight bytes at a time through a multiply-xorshift; never 0, which marks a free way. */
+uint64_t hash_cache_key(const uint8_t *payload, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, payload, 8);
+        h = mix(h ^ w) + 0x9e3779b97f4a7c15ULL;
+        payload += 8;
+        len -= 8;
+    }
+    if (len) {
+        uint64_t w = 0;
+        memcpy(&w, payload, len);
+        h = mix(h ^ w ^ 0xff);
+    }
+    h = mix(h);
+    return h ? h : 1;
+}
+
+const uint32_t *hash_cache_lookup(struct hash_cache *hc, uint64_t key, const uint8_t *payload, size_t len) {
+    struct hash_cache_set *set = &hc->sets[key & hc->mask];
+    for (int w = 0; w < HASH_CACHE_WAYS; w++) {
+        if (set->keys[w] == key && set->lens[w] == len && memcmp(set->entries[w].payload, payload, len) == 0) {
+            set->refs[w] = 1;
+            hc->hits++;
+            return set->entries[w].h;
+        }
+    }
+    hc->misses++;
+    return NULL;
+}
+
+void hash_cache_insert(struct hash_cache *hc, uint64_t key, const uint8_t *payload, size_t len, const uint32_t h[8]) {
+    if (len > HASH_CACHE_MAX_PAYLOAD) return;
+    struct hash_cache_set *set = &hc->sets[key & hc->mask];
+    int victim = -1;
+    for (int w = 0; w < HASH_CACHE_WAYS; w++) {
+        if (set->keys[w] == key && set->lens[w] == len && memcmp(set->entries[w].payload, payload, len) == 0) {
+            return;     /* a duplicate from the same batch got here first */
+        }
+        if (victim < 0 && set->keys[w] == 0) victim = w;
+    }
+    if (victim < 0) {
+        /* CLOCK: clear reference bits until the hand finds a way nobody hit since its last pass */
+        while (set->refs[set->hand]) {
+            set->refs[set->hand] = 0;
+            set->hand = (set->hand + 1) % HASH_CACHE_WAYS;
+        }
+        victim = set->hand;
+        set->hand = (set->hand + 1) % HASH_CACHE_WAYS;
+        hc->evictions++;
+    }
+    set->keys[victim] = key;
+    set->lens[victim] = (uint16_t) len;
+    set->refs[victim] = 0;
+    memcpy(set->entries[victim].h, h, sizeof(set->entries[victim].h));
+    memcpy(set->entries[victim].payload, payload, len);
+    hc->inserts++;
+}
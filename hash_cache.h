@@ -0,0 +1,49 @@
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded cache from request payload to the final SHA-256 state of
+ * salt || payload. Lookups go by a 64-bit non-cryptographic prehash of the
+ * payload, and a hit also compares the stored payload byte for byte, so a
+ * prehash collision can never return someone else's digest.
+ *
+ * The table is 8-way set associative; each set evicts with its own CLOCK
+ * hand. It is not locked: every reactor owns a separate cache.
+ */
+
+#define HASH_CACHE_MAX_PAYLOAD 224
+#define HASH_CACHE_WAYS 8
+
+struct hash_cache_entry {
+    uint32_t h[8];
+    uint8_t payload[HASH_CACHE_MAX_PAYLOAD];
+};
+
+struct hash_cache_set {
+    uint64_t keys[HASH_CACHE_WAYS];     /* 0 marks a free way */
+    uint16_t lens[HASH_CACHE_WAYS];
+    uint8_t refs[HASH_CACHE_WAYS];      /* CLOCK reference bits */
+    uint8_t hand;
+    struct hash_cache_entry entries[HASH_CACHE_WAYS];
+};
+
+struct hash_cache {
+    struct hash_cache_set *sets;
+    size_t mask;                        /* number of sets - 1 */
+    uint64_t hits, misses, inserts, evictions;
+};
+
+/* Size the table to at most budget bytes (at least one set). Returns -1 if out of memory. */
+int hash_cache_init(struct hash_cache *hc, size_t budget);
+void hash_cache_free(struct hash_cache *hc);
+size_t hash_cache_capacity(const struct hash_cache *hc);
+
+uint64_t hash_cache_key(const uint8_t *payload, size_t len);
+/* The cached state for this payload, or NULL. */
+const uint32_t *hash_cache_lookup(struct hash_cache *hc, uint64_t key, const uint8_t *payload, size_t len);
+void hash_cache_insert(struct hash_cache *hc, uint64_t key, const uint8_t *payload, size_t len, const uint32_t h[8]);
+
+#endif
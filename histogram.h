@@ -0,0 +1,82 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram. Values below
+ * HIST_SUB are counted exactly; above that every power of two is split into
+ * HIST_SUB / 2 buckets, so any recorded value is off by less than 1%.
+ * Recording is a couple of shifts and an increment with no synchronisation:
+ * each thread owns its histogram and they are merged only when read.
+ */
+
+#define HIST_SUB_BITS 8
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 42        /* ~73 minutes in nanoseconds */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS) * (HIST_SUB / 2) + HIST_SUB)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HIST_BUCKETS];
+};
+
+static inline void histogram_reset(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int histogram_index(uint64_t v) {
+    if (v < HIST_SUB) return (int) v;
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS + 1;
+    return shift * (HIST_SUB / 2) + (int) (v >> shift);
+}
+
+/* Largest value that lands in bucket idx. */
+static inline uint64_t histogram_bucket_value(int idx) {
+    if (idx < HIST_SUB) return (uint64_t) idx;
+    int shift = (idx - HIST_SUB) / (HIST_SUB / 2) + 1;
+    uint64_t sub = (uint64_t) (idx - shift * (HIST_SUB / 2));
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t v) {
+    h->counts[histogram_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+static inline void histogram_merge(struct histogram *dst, const struct histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+/* Value at percentile p (0-100]; exact max for p == 100. */
+static inline uint64_t histogram_percentile(const struct histogram *h, double p) {
+    if (h->count == 0) return 0;
+    if (p >= 100.0) return h->max;
+    uint64_t target = (uint64_t) (p / 100.0 * h->count + 0.5);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t v = histogram_bucket_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
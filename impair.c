@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include "impair.h"
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Expanding the seed with splitmix64 never yields the all-zero state xoshiro cannot leave */
+void xoshiro_seed(struct xoshiro *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = splitmix64(&seed);
+}
+
+void impair_init(struct impair *im, const struct impair_config *cfg, uint64_t seed) {
+    memset(im, 0, sizeof(*im));
+    im->cfg = cfg;
+    xoshiro_seed(&im->rng, seed);
+}
+
+int impair_drop(struct impair *im) {
+    const struct impair_config *c = im->cfg;
+    if (c->burst_enter > 0) {
+        if (xoshiro_uniform(&im->rng) < (im->bad ? c->burst_leave : c->burst_enter)) im->bad = !im->bad;
+    }
+    double loss = im->bad ? c->burst_loss : c->drop;
+    return loss > 0 && xoshiro_uniform(&im->rng) < loss;
+}
+
+static inline int earlier(const struct held_datagram *a, const struct held_datagram *b) {
+    return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static int hold(struct impair *im, int64_t due, const struct sockaddr_in *to, const uint8_t *data, size_t len) {
+    if (im->nheld == im->cap) {
+        size_t cap = im->cap ? im->cap * 2 : 256;
+        struct held_datagram *held = realloc(im->held, cap * sizeof(*held));
+        if (!held) return -1;
+        im->held = held;
+        im->cap = cap;
+    }
+    struct held_datagram d = { .due = due, .order = im->order++, .to = *to, .len = len };
+    memcpy(d.data, data, len);
+    size_t i = im->nheld++;
+    for (; i > 0 && earlier(&d, &im->held[(i - 1) / 2]); i = (i - 1) / 2) im->held[i] = im->held[(i - 1) / 2];
+    im->held[i] = d;
+    return 0;
+}
+
+int impair_response(struct impair *im, int64_t now, const struct sockaddr_in *to, const uint8_t *data, size_t len) {
+    const struct impair_config *c = im->cfg;
+    int copies = 1;
+    if (c->duplicate > 0 && xoshiro_uniform(&im->rng) < c->duplicate) {
+        copies = 2;
+        im->duplicated++;
+    }
+    if ((c->delay_ns == 0 && c->jitter_ns == 0 && c->reorder == 0) || len > HELD_MAX_LEN) return copies;
+    int now_copies = 0;
+    for (int i = 0; i < copies; i++) {
+        /* Every copy draws its own delay, so a duplicate can arrive before the original */
+        int64_t due = now + c->delay_ns;
+        if (c->jitter_ns) due += (int64_t) (xoshiro_uniform(&im->rng) * c->jitter_ns);
+        if (c->reorder > 0 && xoshiro_uniform(&im->rng) < c->reorder) {
+            due += c->reorder_ns;
+            im->reordered++;
+        }
+        if (due <= now) {
+            now_copies++;
+        } else {
+            hold(im, due, to, data, len);
+        }
+    }
+    return now_copies;
+}
+
+int impair_due(struct impair *im, int64_t now, struct held_datagram *out) {
+    if (im->nheld == 0 || im->held[0].due > now) return 0;
+    *out = im->held[0];
+    struct held_datagram last = im->held[--im->nheld];
+    size_t i = 0;
+    for (size_t child; (child = 2 * i + 1) < im->nheld; i = child) {
+        if (child + 1 < im->nheld && earlier(&im->held[child + 1], &im->held[child])) child++;
+        if (!earlier(&im->held[child], &last)) break;
+        im->held[i] = im->held[child];
+    }
+    im->held[i] = last;
+    return 1;
+}
@@ -0,0 +1,102 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * Simulated network impairments for udp_server: loss, burst loss,
+ * reordering, duplication and delay, all decided by a per-worker
+ * xoshiro256** generator so a run with a given --seed and the same arrival
+ * order makes the same decisions.
+ *
+ * Loss follows the Gilbert-Elliott model: a good and a bad state, with a
+ * chance per request to move from one to the other and a loss rate of its
+ * own in each. With burst_enter 0 the bad state is never entered and the
+ * loss is plain Bernoulli at drop. Responses that are delayed, reordered or
+ * duplicated wait in a timer queue ordered by due time, which the worker
+ * drains between batches; nothing ever sleeps.
+ *
+ * Not locked: every worker owns one.
+ */
+
+struct xoshiro {
+    uint64_t s[4];
+};
+
+void xoshiro_seed(struct xoshiro *r, uint64_t seed);
+
+static inline uint64_t xoshiro_next(struct xoshiro *r) {
+    uint64_t *s = r->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = (x << 7 | x >> 57) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = s[3] << 45 | s[3] >> 19;
+    return result;
+}
+
+/* Uniform in [0, 1), with all 53 bits of a double */
+static inline double xoshiro_uniform(struct xoshiro *r) {
+    return (double) (xoshiro_next(r) >> 11) * 0x1p-53;
+}
+
+/* Probabilities in [0, 1], times in ns. */
+struct impair_config {
+    double drop;                /* loss in the good state */
+    double burst_enter;         /* good -> bad, per request */
+    double burst_leave;         /* bad -> good, per request */
+    double burst_loss;          /* loss in the bad state */
+    double reorder;             /* a response is held back by reorder_ns so later ones overtake it */
+    int64_t reorder_ns;
+    double duplicate;           /* a response is sent twice */
+    int64_t delay_ns;           /* every response waits this long, plus up to jitter_ns more */
+    int64_t jitter_ns;
+};
+
+#define HELD_MAX_LEN 40
+
+struct held_datagram {
+    int64_t due;                /* monotonic ns */
+    uint64_t order;             /* ties leave in the order they were queued */
+    struct sockaddr_in to;
+    size_t len;
+    uint8_t data[HELD_MAX_LEN];
+};
+
+struct impair {
+    const struct impair_config *cfg;
+    struct xoshiro rng;
+    int bad;
+    struct held_datagram *held; /* min-heap on (due, order) */
+    size_t nheld, cap;
+    uint64_t order;
+    uint64_t duplicated, reordered;
+};
+
+void impair_init(struct impair *im, const struct impair_config *cfg, uint64_t seed);
+
+/* Whether the next request is lost. */
+int impair_drop(struct impair *im);
+
+/*
+ * Decide what happens to a response. Returns how many copies to send right
+ * away (0 to 2); the others were queued and come out of impair_due. A
+ * copy that cannot be queued for lack of memory is lost.
+ */
+int impair_response(struct impair *im, int64_t now, const struct sockaddr_in *to, const uint8_t *data, size_t len);
+
+/* Due time of the earliest queued response, or -1 if none. */
+static inline int64_t impair_next_due(const struct impair *im) {
+    return im->nheld ? im->held[0].due : -1;
+}
+
+/* Move the earliest queued response into out if it is due by now. Returns 0 if there is none. */
+int impair_due(struct impair *im, int64_t now, struct held_datagram *out);
+
+#endif
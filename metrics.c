@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "metrics.h"
+
+static uint64_t load(const struct metrics_registry *reg, int thread, size_t offset) {
+    const uint8_t *block = (const uint8_t *) reg->blocks + (size_t) thread * reg->stride;
+    return __atomic_load_n((const uint64_t *) (block + offset), __ATOMIC_RELAXED);
+}
+
+static void write_hist(const struct metrics_registry *reg, const struct metric_desc *d, FILE *out) {
+    uint64_t buckets[METRICS_BUCKETS] = { 0 }, sum = 0, count = 0;
+    for (int t = 0; t < reg->nthreads; t++) {
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            buckets[i] += load(reg, t, d->offset + offsetof(struct metrics_hist, buckets) + i * sizeof(uint64_t));
+        }
+        sum += load(reg, t, d->offset + offsetof(struct metrics_hist, sum));
+    }
+    /* The count comes from the buckets themselves so the +Inf bucket always agrees with them */
+    for (int i = 0; i <= d->hi && i < METRICS_BUCKETS - 1; i++) {
+        count += buckets[i];
+        if (i >= d->lo) {
+            fprintf(out, "%s_%s_bucket{le=\"%g\"} %llu\n", reg->prefix, d->name, (double) (1ULL << i) * d->scale,
+                    (unsigned long long) count);
+        }
+    }
+    for (int i = d->hi + 1; i < METRICS_BUCKETS; i++) count += buckets[i];
+    fprintf(out, "%s_%s_bucket{le=\"+Inf\"} %llu\n", reg->prefix, d->name, (unsigned long long) count);
+    fprintf(out, "%s_%s_sum %.9g\n", reg->prefix, d->name, sum * d->scale);
+    fprintf(out, "%s_%s_count %llu\n", reg->prefix, d->name, (unsigned long long) count);
+}
+
+void metrics_write(const struct metrics_registry *reg, FILE *out) {
+    static const char *types[] = { "counter", "gauge", "histogram" };
+    for (int k = 0; k < reg->ndescs; k++) {
+        const struct metric_desc *d = &reg->descs[k];
+        fprintf(out, "# HELP %s_%s %s\n", reg->prefix, d->name, d->help);
+        fprintf(out, "# TYPE %s_%s %s\n", reg->prefix, d->name, types[d->type]);
+        if (d->type == METRIC_HISTOGRAM) {
+            write_hist(reg, d, out);
+            continue;
+        }
+        uint64_t v = 0;
+        for (int t = 0; t < reg->nthreads; t++) v += load(reg, t, d->offset);
+        fprintf(out, "%s_%s %llu\n", reg->prefix, d->name, (unsigned long long) v);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------------------------------- */
+
+struct metrics_server {
+    const struct metrics_registry *reg;
+    int listenfd;
+    int interval;
+};
+
+static int send_all(int fd, const char *p, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* One scrape per connection; whatever was asked for, the answer is the metrics. */
+static void serve(const struct metrics_registry *reg, int fd) {
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char req[1024];
+    if (recv(fd, req, sizeof(req), 0) <= 0) return;
+
+    char *body = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&body, &len);
+    if (!f) return;
+    metrics_write(reg, f);
+    fclose(f);
+    char hdr[160];
+    int h = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    if (send_all(fd, hdr, h) == 0) send_all(fd, body, len);
+    free(body);
+}
+
+static int64_t mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *metrics_main(void *arg) {
+    struct metrics_server *s = arg;
+    int64_t next = mono_ms() + (int64_t) s->interval * 1000;
+    for (;;) {
+        int timeout = -1;
+        if (s->interval) {
+            int64_t left = next - mono_ms();
+            timeout = left > 0 ? (int) left : 0;
+        }
+        struct pollfd pfd = { .fd = s->listenfd, .events = POLLIN };
+        int n = poll(&pfd, 1, timeout);
+        if (n > 0) {
+            int fd = accept4(s->listenfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                serve(s->reg, fd);
+                close(fd);
+            }
+        }
+        if (s->interval && mono_ms() >= next) {
+            metrics_write(s->reg, stderr);
+            fflush(stderr);
+            next += (int64_t) s->interval * 1000;
+        }
+    }
+    return NULL;
+}
+
+void metrics_start(const struct metrics_registry *reg, int port, int interval) {
+    if (!port && !interval) return;
+    struct metrics_server *s = calloc(1, sizeof(*s));
+    if (!s) {
+        perror("calloc");
+        exit(1);
+    }
+    s->reg = reg;
+    s->interval = interval;
+    s->listenfd = -1;           /* poll() ignores it */
+    if (port) {
+        struct sockaddr_in addr;
+        s->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s->listenfd == -1) {
+            perror("socket");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(s->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(s->listenfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(s->listenfd, 16) != 0) {
+            perror("stats listener");
+            exit(1);
+        }
+    }
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, metrics_main, s);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+    pthread_detach(thread);
+}
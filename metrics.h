@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per-thread counters, gauges and histograms, summed only when someone
+ * reads them. Every thread owns a cache-line aligned block that only it
+ * writes; the stats thread reads all blocks. Writes are relaxed atomic
+ * stores of a value computed with a plain load, which compile to ordinary
+ * moves: no lock prefix and no shared cache lines on the request path.
+ */
+
+#define METRICS_BUCKETS 40      /* bucket i counts values in (2^(i-1), 2^i]; the last one also takes the rest */
+
+struct metrics_hist {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t sum;
+};
+
+static inline void metric_add(uint64_t *c, uint64_t v) {
+    __atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(uint64_t *g, uint64_t v) {
+    __atomic_store_n(g, v, __ATOMIC_RELAXED);
+}
+
+static inline void metric_observe(struct metrics_hist *h, uint64_t v) {
+    int i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1);
+    if (i >= METRICS_BUCKETS) i = METRICS_BUCKETS - 1;
+    metric_add(&h->buckets[i], 1);
+    metric_add(&h->sum, v);
+}
+
+enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+};
+
+/* Where a metric lives inside each thread's block, and how to print it. */
+struct metric_desc {
+    const char *name;
+    const char *help;
+    enum metric_type type;
+    size_t offset;              /* of a uint64_t, or of a struct metrics_hist */
+    double scale;               /* histograms: printed value per recorded unit, e.g. 1e-9 for ns as seconds */
+    int lo, hi;                 /* histograms: range of buckets worth printing */
+};
+
+struct metrics_registry {
+    const char *prefix;         /* prepended to every name, e.g. "tcp_server" */
+    const struct metric_desc *descs;
+    int ndescs;
+    const void *blocks;         /* nthreads blocks, stride bytes apart */
+    size_t stride;
+    int nthreads;
+};
+
+/* Sum every thread's block and print the result in the Prometheus text format. */
+void metrics_write(const struct metrics_registry *reg, FILE *out);
+
+/*
+ * Serve the metrics over HTTP on port (0 for none) and print them to stderr
+ * every interval seconds (0 for never), from a thread of their own.
+ */
+void metrics_start(const struct metrics_registry *reg, int port, int interval);
+
+#endif
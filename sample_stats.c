@@ -0,0 +1,179 @@
+#include <math.h>
+#include <string.h>
+#include "sample_stats.h"
+
+#define SKETCH_GAMMA 1.02
+
+static void moments_add(struct moments *m, double v) {
+    m->n++;
+    if (m->n == 1 || v < m->min) m->min = v;
+    if (m->n == 1 || v > m->max) m->max = v;
+    /* Welford: no catastrophic cancellation however many samples */
+    double d = v - m->mean;
+    m->mean += d / m->n;
+    m->m2 += d * (v - m->mean);
+}
+
+/* Chan et al.: the moments of the union from those of the parts */
+static void moments_merge(struct moments *dst, const struct moments *src) {
+    if (src->n == 0) return;
+    if (dst->n == 0) {
+        *dst = *src;
+        return;
+    }
+    uint64_t n = dst->n + src->n;
+    double d = src->mean - dst->mean;
+    dst->mean += d * src->n / n;
+    dst->m2 += src->m2 + d * d * dst->n * src->n / n;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->n = n;
+}
+
+static void sketch_add(struct sketch *k, double v) {
+    double ns = fabs(v) * 1e9;
+    k->count++;
+    if (ns < 1) {
+        k->zero++;
+        return;
+    }
+    int i = (int) ceil(log(ns) / log(SKETCH_GAMMA));
+    if (i >= SKETCH_BUCKETS) i = SKETCH_BUCKETS - 1;
+    if (v > 0) {
+        k->pos[i]++;
+    } else {
+        k->neg[i]++;
+    }
+}
+
+/* Middle of bucket i, in seconds */
+static double bucket_value(int i) {
+    return 2 * pow(SKETCH_GAMMA, i) / (SKETCH_GAMMA + 1) * 1e-9;
+}
+
+double sketch_quantile(const struct sketch *k, double q) {
+    if (k->count == 0) return 0;
+    uint64_t rank = (uint64_t) (q * (k->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = SKETCH_BUCKETS - 1; i >= 0; i--) {
+        seen += k->neg[i];
+        if (seen >= rank) return -bucket_value(i);
+    }
+    seen += k->zero;
+    if (seen >= rank) return 0;
+    for (int i = 0; i < SKETCH_BUCKETS; i++) {
+        seen += k->pos[i];
+        if (seen >= rank) return bucket_value(i);
+    }
+    return bucket_value(SKETCH_BUCKETS - 1);
+}
+
+void sample_stats_init(struct sample_stats *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void sample_stats_add(struct sample_stats *s, double theta, double delta, int retransmitted) {
+    s->received++;
+    moments_add(&s->theta, theta);
+    moments_add(&s->delta, delta);
+    sketch_add(&s->theta_q, theta);
+    sketch_add(&s->delta_q, delta);
+    if (retransmitted) {
+        s->retransmitted++;
+        return;
+    }
+    s->filter_theta[s->filter_next] = theta;
+    s->filter_delta[s->filter_next] = delta;
+    s->filter_next = (s->filter_next + 1) % CLOCK_FILTER_SIZE;
+    if (s->filter_len < CLOCK_FILTER_SIZE) s->filter_len++;
+    if (!s->have_best || delta < s->best_delta) {
+        s->best_theta = theta;
+        s->best_delta = delta;
+        s->have_best = 1;
+    }
+}
+
+void sample_stats_drop(struct sample_stats *s) {
+    s->dropped++;
+}
+
+double sample_stats_filter_offset(const struct sample_stats *s) {
+    int best = -1;
+    for (int i = 0; i < s->filter_len; i++) {
+        if (best < 0 || s->filter_delta[i] < s->filter_delta[best]) best = i;
+    }
+    return best < 0 ? 0 : s->filter_theta[best];
+}
+
+void sample_stats_merge(struct sample_stats *dst, const struct sample_stats *src) {
+    dst->received += src->received;
+    dst->dropped += src->dropped;
+    dst->retransmitted += src->retransmitted;
+    moments_merge(&dst->theta, &src->theta);
+    moments_merge(&dst->delta, &src->delta);
+    const struct sketch *from[2] = { &src->theta_q, &src->delta_q };
+    struct sketch *to[2] = { &dst->theta_q, &dst->delta_q };
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < SKETCH_BUCKETS; i++) {
+            to[k]->pos[i] += from[k]->pos[i];
+            to[k]->neg[i] += from[k]->neg[i];
+        }
+        to[k]->zero += from[k]->zero;
+        to[k]->count += from[k]->count;
+    }
+    for (int i = 0; i < src->filter_len; i++) {
+        int slot = dst->filter_len;
+        if (slot == CLOCK_FILTER_SIZE) {
+            slot = 0;
+            for (int j = 1; j < CLOCK_FILTER_SIZE; j++) {
+                if (dst->filter_delta[j] > dst->filter_delta[slot]) slot = j;
+            }
+            if (src->filter_delta[i] >= dst->filter_delta[slot]) continue;
+        } else {
+            dst->filter_len++;
+        }
+        dst->filter_theta[slot] = src->filter_theta[i];
+        dst->filter_delta[slot] = src->filter_delta[i];
+    }
+    dst->filter_next = dst->filter_len % CLOCK_FILTER_SIZE;
+    if (src->have_best && (!dst->have_best || src->best_delta < dst->best_delta)) {
+        dst->best_theta = src->best_theta;
+        dst->best_delta = src->best_delta;
+        dst->have_best = 1;
+    }
+}
+
+void sample_summary_add(struct sample_summary *s, double theta, double delta, int retransmitted) {
+    s->received++;
+    moments_add(&s->delta, delta);
+    if (retransmitted) {
+        s->retransmitted++;
+        return;
+    }
+    if (!s->have_best || delta < s->best_delta) {
+        s->best_theta = theta;
+        s->best_delta = delta;
+        s->have_best = 1;
+    }
+}
+
+static void report_line(FILE *out, const char *label, const char *name, const struct moments *m, const struct sketch *k) {
+    double sd = m->n > 1 ? sqrt(m->m2 / (m->n - 1)) : 0;
+    fprintf(out, "%s%s min %.6f mean %.6f max %.6f sd %.6f p50 %.6f p90 %.6f p99 %.6f p99.9 %.6f\n", label, name,
+            m->min, m->mean, m->max, sd, sketch_quantile(k, 0.5), sketch_quantile(k, 0.9), sketch_quantile(k, 0.99),
+            sketch_quantile(k, 0.999));
+}
+
+void sample_stats_report(const struct sample_stats *s, FILE *out, const char *label) {
+    uint64_t total = s->received + s->dropped;
+    fprintf(out, "%ssamples %llu received %llu dropped %llu (%.2f%%) retransmitted %llu\n", label,
+            (unsigned long long) total, (unsigned long long) s->received, (unsigned long long) s->dropped,
+            total ? 100.0 * s->dropped / total : 0.0, (unsigned long long) s->retransmitted);
+    if (s->received == 0) return;
+    report_line(out, label, "theta", &s->theta, &s->theta_q);
+    report_line(out, label, "delta", &s->delta, &s->delta_q);
+    if (s->have_best) {
+        fprintf(out, "%soffset filter %.6f best %.6f (delta %.6f)\n", label, sample_stats_filter_offset(s),
+                s->best_theta, s->best_delta);
+    }
+}
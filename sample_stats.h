@@ -0,0 +1,84 @@
+#ifndef SAMPLE_STATS_H
+#define SAMPLE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Constant-memory statistics over (theta, delta) samples of the UDP time
+ * protocol, for runs too long to keep every sample.
+ *
+ * Quantiles come from a log-bucketed sketch: bucket i holds magnitudes in
+ * (g^(i-1), g^i] ns with g = 1.02, so any quantile is within 1% of a value
+ * that was actually seen. The offset estimate follows NTP's clock filter:
+ * of the last CLOCK_FILTER_SIZE samples, the one with the lowest delay
+ * has the least queueing in it, and its theta is the current offset. The
+ * best offset is the theta of the lowest-delay sample of the whole run.
+ * Samples answered after a retransmission count everywhere except in
+ * these two estimates, because their send time is ambiguous.
+ */
+
+#define SKETCH_BUCKETS 1280     /* 1 ns to about 100 s */
+#define CLOCK_FILTER_SIZE 8
+
+struct sketch {
+    uint32_t pos[SKETCH_BUCKETS];
+    uint32_t neg[SKETCH_BUCKETS];
+    uint64_t zero;
+    uint64_t count;
+};
+
+struct moments {
+    uint64_t n;
+    double mean, m2;
+    double min, max;
+};
+
+struct sample_stats {
+    uint64_t received, dropped, retransmitted;
+    struct moments theta, delta;
+    struct sketch theta_q, delta_q;
+    double filter_theta[CLOCK_FILTER_SIZE], filter_delta[CLOCK_FILTER_SIZE];
+    int filter_len, filter_next;
+    double best_theta, best_delta;
+    int have_best;
+};
+
+void sample_stats_init(struct sample_stats *s);
+void sample_stats_add(struct sample_stats *s, double theta, double delta, int retransmitted);
+void sample_stats_drop(struct sample_stats *s);
+double sketch_quantile(const struct sketch *k, double q);
+/* The theta of the lowest-delay sample among the last few; 0 if none. */
+double sample_stats_filter_offset(const struct sample_stats *s);
+
+/* Fold src into dst as if dst had seen its samples too; the clock filter keeps the lowest delays of both. */
+void sample_stats_merge(struct sample_stats *dst, const struct sample_stats *src);
+
+/* One line per quantity: count, min, mean, max, stddev and the 50/90/99/99.9th percentiles, then the offsets. */
+void sample_stats_report(const struct sample_stats *s, FILE *out, const char *label);
+
+/* What udp_client --clients keeps for each virtual client: the sketches would not fit thousands of times. */
+struct sample_summary {
+    uint64_t received, dropped, retransmitted;
+    struct moments delta;
+    double best_theta, best_delta;
+    int have_best;
+};
+
+void sample_summary_add(struct sample_summary *s, double theta, double delta, int retransmitted);
+
+/*
+ * Binary sample log: one little-endian record per request, written as
+ * the requests are settled, which need not be in sequence order.
+ */
+#define SAMPLE_DROPPED 1
+#define SAMPLE_RETRANSMITTED 2
+
+struct __attribute__((__packed__)) sample_record {
+    uint32_t seq;
+    uint32_t flags;
+    int64_t theta_ns;
+    int64_t delta_ns;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include <string.h>
+#include "sha256.h"
+
+const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void sha256_compress_scalar(uint32_t h[8], const uint8_t *blocks, size_t nblocks) {
+    uint32_t w[64];
+    while (nblocks--) {
+        for (int i = 0; i < 16; i++) w[i] = load_be32(blocks + 4 * i);
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+        blocks += SHA256_BLOCK_SIZE;
+    }
+}
+
+size_t sha256_pad(uint8_t *buf, size_t tail, uint64_t total_len) {
+    size_t padded = SHA256_PADDED_SIZE(tail);
+    buf[tail] = 0x80;
+    memset(buf + tail + 1, 0, padded - tail - 9);
+    uint64_t bits = total_len * 8;
+    store_be32(buf + padded - 8, (uint32_t) (bits >> 32));
+    store_be32(buf + padded - 4, (uint32_t) bits);
+    return padded;
+}
+
+void sha256_digest(const uint32_t h[8], uint8_t out[SHA256_DIGEST_SIZE]) {
+    for (int i = 0; i < 8; i++) store_be32(out + 4 * i, h[i]);
+}
+
+void sha256_init(struct sha256_ctx *ctx, const uint32_t h[8], const uint8_t *tail, size_t tail_len, uint64_t total) {
+    memcpy(ctx->h, h ? h : sha256_iv, sizeof(ctx->h));
+    memcpy(ctx->buf, tail, tail_len);
+    ctx->buflen = tail_len;
+    ctx->total = total;
+}
+
+/* Whole blocks are compressed straight from data; only a ragged head and tail are copied. */
+void sha256_update(struct sha256_ctx *ctx, const uint8_t *data, size_t len) {
+    ctx->total += len;
+    if (ctx->buflen) {
+        size_t n = SHA256_BLOCK_SIZE - ctx->buflen;
+        if (n > len) n = len;
+        memcpy(ctx->buf + ctx->buflen, data, n);
+        ctx->buflen += n;
+        data += n;
+        len -= n;
+        if (ctx->buflen < SHA256_BLOCK_SIZE) return;
+        sha256_compress(ctx->h, ctx->buf, 1);
+        ctx->buflen = 0;
+    }
+    size_t nblocks = len / SHA256_BLOCK_SIZE;
+    if (nblocks) {
+        sha256_compress(ctx->h, data, nblocks);
+        data += nblocks * SHA256_BLOCK_SIZE;
+        len -= nblocks * SHA256_BLOCK_SIZE;
+    }
+    memcpy(ctx->buf, data, len);
+    ctx->buflen = len;
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t out[SHA256_DIGEST_SIZE]) {
+    uint8_t pad[2 * SHA256_BLOCK_SIZE];
+    memcpy(pad, ctx->buf, ctx->buflen);
+    size_t padded = sha256_pad(pad, ctx->buflen, ctx->total);
+    sha256_compress(ctx->h, pad, padded / SHA256_BLOCK_SIZE);
+    sha256_digest(ctx->h, out);
+}
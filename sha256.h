@@ -0,0 +1,95 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+/* Number of bytes a message of len bytes occupies once padded. */
+#define SHA256_PADDED_SIZE(len) ((((len) + 9 + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE) * SHA256_BLOCK_SIZE)
+
+extern const uint32_t sha256_iv[8];
+
+/*
+ * Compress nblocks consecutive 64-byte blocks into the chaining state h,
+ * using the kernel chosen by sha256_kernel_select().
+ */
+void sha256_compress(uint32_t h[8], const uint8_t *blocks, size_t nblocks);
+void sha256_compress_scalar(uint32_t h[8], const uint8_t *blocks, size_t nblocks);
+
+enum sha256_kernel {
+    SHA256_KERNEL_AUTO,
+    SHA256_KERNEL_SCALAR,
+    SHA256_KERNEL_SHANI,
+    SHA256_KERNEL_ARMV8,
+};
+
+/* Pick a kernel; SHA256_KERNEL_AUTO takes the hardware one if the CPU has it. Returns -1 if unsupported. */
+int sha256_kernel_select(enum sha256_kernel k);
+int sha256_kernel_supported(enum sha256_kernel k);
+int sha256_kernel_parse(const char *name, enum sha256_kernel *k);
+const char *sha256_kernel_name(void);
+enum sha256_kernel sha256_kernel_current(void);
+
+/*
+ * Append SHA-256 padding for a message of total_len bytes whose last
+ * (total_len % 64) bytes already sit at buf[0..tail). Returns the number of
+ * padded bytes, which is a multiple of the block size.
+ */
+size_t sha256_pad(uint8_t *buf, size_t tail, uint64_t total_len);
+
+void sha256_digest(const uint32_t h[8], uint8_t out[SHA256_DIGEST_SIZE]);
+
+/*
+ * Incremental hashing for messages that arrive in pieces. A context may be
+ * seeded with any chaining state plus a partial block, e.g. a precomputed
+ * salt midstate, in which case total counts the bytes that state covers.
+ */
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t total;
+    size_t buflen;
+    uint8_t buf[SHA256_BLOCK_SIZE];
+};
+
+void sha256_init(struct sha256_ctx *ctx, const uint32_t h[8], const uint8_t *tail, size_t tail_len, uint64_t total);
+void sha256_update(struct sha256_ctx *ctx, const uint8_t *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t out[SHA256_DIGEST_SIZE]);
+
+/* -------------------------------------------------------------------------------------------------------------------------- */
+
+/*
+ * Multi-buffer engine: hashes independent, already padded messages in
+ * parallel SIMD lanes. Each job starts from the chaining state in h and
+ * leaves its final state there.
+ */
+struct sha256_mb_job {
+    const uint8_t *blocks;
+    unsigned nblocks;
+    uint32_t h[8];
+};
+
+enum sha256_mb_engine {
+    SHA256_MB_AUTO,
+    SHA256_MB_SCALAR,
+    SHA256_MB_AVX2,
+    SHA256_MB_AVX512,
+};
+
+/*
+ * Pick an engine; SHA256_MB_AUTO takes AVX-512 if present, otherwise hashes
+ * one job at a time when a hardware kernel is selected (SHA-NI outruns the
+ * AVX2 lanes), otherwise AVX2. Select the kernel first. Returns -1 if
+ * unsupported.
+ */
+int sha256_mb_select(enum sha256_mb_engine engine);
+int sha256_mb_parse(const char *name, enum sha256_mb_engine *engine);
+const char *sha256_mb_name(void);
+int sha256_mb_lanes(void);
+
+/* Hash njobs jobs; order is scratch room for njobs pointers. */
+void sha256_mb_run(struct sha256_mb_job *jobs, int njobs, struct sha256_mb_job **order);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Cycles per byte of every SHA-256 kernel this machine supports, for
+ * payloads from 1 to MAX_DATASIZE bytes, hashed the way the server does:
+ * copy into a padded buffer and compress. The multi-buffer engines are
+ * measured on full batches of same-sized messages for comparison. Every
+ * kernel and engine is checked against the FIPS 180-2 test vectors and the
+ * portable kernel before it is timed.
+ *
+ * Usage: sha256_bench [iterations]
+ */
+
+#define MAX_DATASIZE 224
+#define BATCH 64
+
+static const size_t sizes[] = { 1, 8, 16, 32, 48, 55, 56, 64, 96, 119, 120, 128, 160, 192, 224 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t msg[MAX_DATASIZE];
+
+static void hash_one(const uint8_t *data, size_t len, uint8_t out[SHA256_DIGEST_SIZE]) {
+    uint8_t buf[SHA256_PADDED_SIZE(MAX_DATASIZE)];
+    uint32_t h[8];
+    memcpy(h, sha256_iv, sizeof(h));
+    memcpy(buf, data, len);
+    size_t padded = sha256_pad(buf, len, len);
+    sha256_compress(h, buf, padded / SHA256_BLOCK_SIZE);
+    sha256_digest(h, out);
+}
+
+/* FIPS 180-2 examples: empty, one block, and a message whose padding needs a second block */
+static const struct {
+    const char *msg;
+    const char *digest;
+} known_answers[] = {
+    { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+};
+#define NKNOWN (sizeof(known_answers) / sizeof(known_answers[0]))
+
+static void hex_decode(const char *hex, uint8_t *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned v;
+        sscanf(hex + 2 * i, "%2x", &v);
+        out[i] = (uint8_t) v;
+    }
+}
+
+/* Digests of every payload size under the portable kernel, to compare the others against. */
+static uint8_t reference[MAX_DATASIZE + 1][SHA256_DIGEST_SIZE];
+
+static int check_kernel(void) {
+    uint8_t out[SHA256_DIGEST_SIZE], expect[SHA256_DIGEST_SIZE];
+    for (size_t k = 0; k < NKNOWN; k++) {
+        hash_one((const uint8_t *) known_answers[k].msg, strlen(known_answers[k].msg), out);
+        hex_decode(known_answers[k].digest, expect, sizeof(expect));
+        if (memcmp(out, expect, sizeof(out)) != 0) return -1;
+    }
+    for (size_t len = 0; len <= MAX_DATASIZE; len++) {
+        hash_one(msg, len, out);
+        if (memcmp(out, reference[len], sizeof(out)) != 0) return -1;
+    }
+    /* Multi-block input in one call, as streams do */
+    static uint8_t big[64 * 1024];
+    uint32_t a[8], b[8];
+    memcpy(a, sha256_iv, sizeof(a));
+    memcpy(b, sha256_iv, sizeof(b));
+    sha256_compress(a, big, sizeof(big) / SHA256_BLOCK_SIZE);
+    sha256_compress_scalar(b, big, sizeof(big) / SHA256_BLOCK_SIZE);
+    return memcmp(a, b, sizeof(a)) == 0 ? 0 : -1;
+}
+
+static void bench_kernel(long iters) {
+    uint8_t out[SHA256_DIGEST_SIZE], data[MAX_DATASIZE];
+    memcpy(data, msg, sizeof(data));
+    printf("%-12s", sha256_kernel_name());
+    for (size_t s = 0; s < NSIZES; s++) {
+        for (long i = 0; i < iters / 10; i++) hash_one(data, sizes[s], out);
+        uint64_t t0 = ticks();
+        for (long i = 0; i < iters; i++) {
+            data[0] = (uint8_t) i;
+            hash_one(data, sizes[s], out);
+        }
+        uint64_t t1 = ticks();
+        printf(" %7.2f", (double) (t1 - t0) / iters / sizes[s]);
+    }
+    printf("\n");
+}
+
+/*
+ * The engine in use on the known answers, then on batches of mixed payload
+ * sizes against the reference digests, so lanes of different lengths share
+ * a run and the tails go through the single-buffer loop too.
+ */
+static int check_engine(void) {
+    static uint8_t bufs[BATCH][SHA256_PADDED_SIZE(MAX_DATASIZE)];
+    struct sha256_mb_job jobs[BATCH], *order[BATCH];
+    uint8_t out[SHA256_DIGEST_SIZE], expect[SHA256_DIGEST_SIZE];
+    for (size_t k = 0; k < NKNOWN; k++) {
+        size_t len = strlen(known_answers[k].msg);
+        memcpy(bufs[k], known_answers[k].msg, len);
+        jobs[k].blocks = bufs[k];
+        jobs[k].nblocks = sha256_pad(bufs[k], len, len) / SHA256_BLOCK_SIZE;
+        memcpy(jobs[k].h, sha256_iv, sizeof(jobs[k].h));
+    }
+    sha256_mb_run(jobs, NKNOWN, order);
+    for (size_t k = 0; k < NKNOWN; k++) {
+        sha256_digest(jobs[k].h, out);
+        hex_decode(known_answers[k].digest, expect, sizeof(expect));
+        if (memcmp(out, expect, sizeof(out)) != 0) return -1;
+    }
+    for (size_t first = 0; first <= MAX_DATASIZE; first += BATCH) {
+        for (int n = 1; n <= BATCH; n *= 2) {
+            for (int j = 0; j < n; j++) {
+                size_t len = (first + (size_t) j * 37) % (MAX_DATASIZE + 1);
+                memcpy(bufs[j], msg, len);
+                jobs[j].blocks = bufs[j];
+                jobs[j].nblocks = sha256_pad(bufs[j], len, len) / SHA256_BLOCK_SIZE;
+                memcpy(jobs[j].h, sha256_iv, sizeof(jobs[j].h));
+            }
+            sha256_mb_run(jobs, n, order);
+            for (int j = 0; j < n; j++) {
+                sha256_digest(jobs[j].h, out);
+                if (memcmp(out, reference[(first + (size_t) j * 37) % (MAX_DATASIZE + 1)], sizeof(out)) != 0) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void bench_engine(long iters) {
+    static uint8_t bufs[BATCH][SHA256_PADDED_SIZE(MAX_DATASIZE)];
+    struct sha256_mb_job jobs[BATCH], *order[BATCH];
+    printf("%-12s", sha256_mb_name());
+    for (size_t s = 0; s < NSIZES; s++) {
+        size_t padded = 0;
+        for (int j = 0; j < BATCH; j++) {
+            memcpy(bufs[j], msg, sizes[s]);
+            padded = sha256_pad(bufs[j], sizes[s], sizes[s]);
+        }
+        long rounds = iters / BATCH + 1;
+        uint64_t t0 = ticks();
+        for (long i = 0; i < rounds; i++) {
+            for (int j = 0; j < BATCH; j++) {
+                jobs[j].blocks = bufs[j];
+                jobs[j].nblocks = padded / SHA256_BLOCK_SIZE;
+                memcpy(jobs[j].h, sha256_iv, sizeof(jobs[j].h));
+            }
+            sha256_mb_run(jobs, BATCH, order);
+        }
+        uint64_t t1 = ticks();
+        printf(" %7.2f", (double) (t1 - t0) / (rounds * BATCH) / sizes[s]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    long iters = argc > 1 ? atol(argv[1]) : 200000;
+    if (iters < 10) iters = 10;
+    for (size_t i = 0; i < sizeof(msg); i++) msg[i] = (uint8_t) (i * 131 + 7);
+
+    sha256_kernel_select(SHA256_KERNEL_SCALAR);
+    for (size_t len = 0; len <= MAX_DATASIZE; len++) hash_one(msg, len, reference[len]);
+
+    /* Calibrate ticks against the wall clock so non-cycle counters can be read as cycles too */
+    double w0 = now_sec();
+    uint64_t c0 = ticks();
+    while (now_sec() - w0 < 0.05) {}
+    double ghz = (ticks() - c0) / (now_sec() - w0) / 1e9;
+    printf("tick rate %.2f GHz; cycles/byte by payload size (salt excluded)\n\n", ghz);
+
+    printf("%-12s", "kernel");
+    for (size_t s = 0; s < NSIZES; s++) printf(" %7zu", sizes[s]);
+    printf("\n");
+
+    int failed = 0;
+    for (int k = SHA256_KERNEL_SCALAR; k <= SHA256_KERNEL_ARMV8; k++) {
+        if (!sha256_kernel_supported(k)) continue;
+        sha256_kernel_select(k);
+        if (check_kernel() != 0) {
+            printf("%-12s WRONG DIGEST\n", sha256_kernel_name());
+            failed = 1;
+            continue;
+        }
+        bench_kernel(iters);
+    }
+
+    /* Multi-buffer engines, with the best single-buffer kernel for their tails */
+    sha256_kernel_select(SHA256_KERNEL_AUTO);
+    printf("\nmulti-buffer, batches of %d:\n", BATCH);
+    for (int e = SHA256_MB_SCALAR; e <= SHA256_MB_AVX512; e++) {
+        if (sha256_mb_select(e) != 0) continue;
+        if (check_engine() != 0) {
+            printf("%-12s WRONG DIGEST\n", sha256_mb_name());
+            failed = 1;
+            continue;
+        }
+        bench_engine(iters);
+    }
+    return failed;
+}
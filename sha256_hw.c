@@ -0,0 +1,172 @@
+#include <string.h>
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA256_HW_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define SHA256_HW_ARM 1
+#endif
+
+/*
+ * Single-buffer compression kernels. Everything that hashes one message at
+ * a time (the multi-buffer engine's short tails, streams, salt midstates)
+ * goes through sha256_compress(), which calls whichever kernel was picked
+ * at startup: the SHA extensions on x86, the crypto extensions on ARMv8,
+ * or the portable C code.
+ */
+
+extern const uint32_t sha256_k[64];
+
+typedef void (*compress_fn)(uint32_t h[8], const uint8_t *blocks, size_t nblocks);
+
+static enum sha256_kernel kernel = SHA256_KERNEL_SCALAR;
+static compress_fn compress = sha256_compress_scalar;
+
+#ifdef SHA256_HW_X86
+
+/*
+ * The SHA extensions keep the state as ABEF/CDGH and do two rounds per
+ * sha256rnds2, taking W+K for both in the low half of the message operand.
+ */
+__attribute__((target("sha,sse4.1")))
+static void compress_shani(uint32_t h[8], const uint8_t *blocks, size_t nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xb1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1b);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    while (nblocks--) {
+        __m128i abef_save = abef, cdgh_save = cdgh;
+        __m128i m[4];
+        for (int i = 0; i < 4; i++) {
+            m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (blocks + 16 * i)), bswap);
+        }
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i >= 4) {
+                /* W[i..i+3] from the four previous groups, oldest first */
+                __m128i w = _mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+                m[i & 3] = _mm_sha256msg2_epu32(w, m[(i + 3) & 3]);
+            }
+            __m128i wk = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e));
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+        blocks += SHA256_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *) &h[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i *) &h[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#endif /* SHA256_HW_X86 */
+
+#ifdef SHA256_HW_ARM
+
+/* sha256h/sha256h2 do four rounds each on the ABCD/EFGH halves. */
+__attribute__((target("+crypto")))
+static void compress_armv8(uint32_t h[8], const uint8_t *blocks, size_t nblocks) {
+    uint32x4_t abcd = vld1q_u32(&h[0]);
+    uint32x4_t efgh = vld1q_u32(&h[4]);
+
+    while (nblocks--) {
+        uint32x4_t abcd_save = abcd, efgh_save = efgh;
+        uint32x4_t m[4];
+        for (int i = 0; i < 4; i++) {
+            m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 16 * i)));
+        }
+        for (int i = 0; i < 16; i++) {
+            if (i >= 4) {
+                m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]), m[(i + 2) & 3], m[(i + 3) & 3]);
+            }
+            uint32x4_t wk = vaddq_u32(m[i & 3], vld1q_u32(&sha256_k[4 * i]));
+            uint32x4_t prev = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, prev, wk);
+        }
+        abcd = vaddq_u32(abcd, abcd_save);
+        efgh = vaddq_u32(efgh, efgh_save);
+        blocks += SHA256_BLOCK_SIZE;
+    }
+
+    vst1q_u32(&h[0], abcd);
+    vst1q_u32(&h[4], efgh);
+}
+
+#endif /* SHA256_HW_ARM */
+
+void sha256_compress(uint32_t h[8], const uint8_t *blocks, size_t nblocks) {
+    compress(h, blocks, nblocks);
+}
+
+int sha256_kernel_supported(enum sha256_kernel k) {
+    switch (k) {
+    case SHA256_KERNEL_AUTO:
+    case SHA256_KERNEL_SCALAR:
+        return 1;
+#ifdef SHA256_HW_X86
+    case SHA256_KERNEL_SHANI:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#endif
+#ifdef SHA256_HW_ARM
+    case SHA256_KERNEL_ARMV8:
+        return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#endif
+    default:
+        return 0;
+    }
+}
+
+int sha256_kernel_select(enum sha256_kernel k) {
+    if (k == SHA256_KERNEL_AUTO) {
+        k = sha256_kernel_supported(SHA256_KERNEL_SHANI) ? SHA256_KERNEL_SHANI
+          : sha256_kernel_supported(SHA256_KERNEL_ARMV8) ? SHA256_KERNEL_ARMV8
+          : SHA256_KERNEL_SCALAR;
+    }
+    if (!sha256_kernel_supported(k)) return -1;
+    switch (k) {
+#ifdef SHA256_HW_X86
+    case SHA256_KERNEL_SHANI: compress = compress_shani; break;
+#endif
+#ifdef SHA256_HW_ARM
+    case SHA256_KERNEL_ARMV8: compress = compress_armv8; break;
+#endif
+    default: compress = sha256_compress_scalar; break;
+    }
+    kernel = k;
+    return 0;
+}
+
+int sha256_kernel_parse(const char *name, enum sha256_kernel *k) {
+    static const char *names[] = { "auto", "scalar", "shani", "armv8" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *k = (enum sha256_kernel) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+enum sha256_kernel sha256_kernel_current(void) {
+    return kernel;
+}
+
+const char *sha256_kernel_name(void) {
+    switch (kernel) {
+    case SHA256_KERNEL_SHANI: return "sha-ni";
+    case SHA256_KERNEL_ARMV8: return "armv8-ce";
+    default: return "scalar";
+    }
+}
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA256_MB_X86 1
+#endif
+
+#define SHA256_MB_MAX_LANES 16
+
+extern const uint32_t sha256_k[64];
+
+static enum sha256_mb_engine mb_engine = SHA256_MB_SCALAR;
+static int mb_lanes = 1;
+
+static const uint8_t zero_block[SHA256_BLOCK_SIZE];
+
+/*
+ * Gather the per-lane block pointers and block counts for up to `lanes`
+ * jobs. Idle lanes hash a zero block whose result is never stored.
+ */
+static unsigned mb_setup(struct sha256_mb_job **jobs, int n, int lanes,
+                         const uint8_t **ptr, unsigned *nb, uint32_t st[8][SHA256_MB_MAX_LANES]) {
+    unsigned maxb = 0;
+    for (int l = 0; l < lanes; l++) {
+        if (l < n) {
+            ptr[l] = jobs[l]->nblocks ? jobs[l]->blocks : zero_block;
+            nb[l] = jobs[l]->nblocks;
+            for (int i = 0; i < 8; i++) st[i][l] = jobs[l]->h[i];
+        } else {
+            ptr[l] = zero_block;
+            nb[l] = 0;
+            for (int i = 0; i < 8; i++) st[i][l] = 0;
+        }
+        if (nb[l] > maxb) maxb = nb[l];
+    }
+    return maxb;
+}
+
+/* After block b, copy out finished lanes and advance the rest. */
+static void mb_advance(struct sha256_mb_job **jobs, int n, unsigned b,
+                       const uint8_t **ptr, const unsigned *nb, uint32_t st[8][SHA256_MB_MAX_LANES]) {
+    for (int l = 0; l < n; l++) {
+        if (nb[l] == b + 1) {
+            for (int i = 0; i < 8; i++) jobs[l]->h[i] = st[i][l];
+            ptr[l] = zero_block;
+        } else if (nb[l] > b + 1) {
+            ptr[l] += SHA256_BLOCK_SIZE;
+        }
+    }
+}
+
+#ifdef SHA256_MB_X86
+
+#define AVX2_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2")))
+static void mb_avx2_x8(struct sha256_mb_job **jobs, int n) {
+    const uint8_t *ptr[8];
+    unsigned nb[8];
+    uint32_t st[8][SHA256_MB_MAX_LANES] __attribute__((aligned(64)));
+    unsigned maxb = mb_setup(jobs, n, 8, ptr, nb, st);
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i s[8];
+    for (int i = 0; i < 8; i++) s[i] = _mm256_load_si256((const __m256i *) st[i]);
+
+    for (unsigned b = 0; b < maxb; b++) {
+        __m256i w[16];
+        for (int t = 0; t < 16; t++) {
+            uint32_t v[8];
+            for (int l = 0; l < 8; l++) memcpy(&v[l], ptr[l] + 4 * t, 4);
+            w[t] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) v), bswap);
+        }
+        __m256i a = s[0], bb = s[1], c = s[2], d = s[3];
+        __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i++) {
+            __m256i wi;
+            if (i < 16) {
+                wi = w[i];
+            } else {
+                __m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(w15, 7), AVX2_ROR(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(w2, 17), AVX2_ROR(w2, 19)), _mm256_srli_epi32(w2, 10));
+                wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+                w[i & 15] = wi;
+            }
+            __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(e, 6), AVX2_ROR(e, 11)), AVX2_ROR(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, _mm256_add_epi32(wi, _mm256_set1_epi32(sha256_k[i]))));
+            __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(a, 2), AVX2_ROR(a, 13)), AVX2_ROR(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, bb), _mm256_and_si256(c, _mm256_or_si256(a, bb)));
+            h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+            d = c; c = bb; bb = a; a = _mm256_add_epi32(t1, _mm256_add_epi32(S0, maj));
+        }
+        s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], bb);
+        s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+        for (int i = 0; i < 8; i++) _mm256_store_si256((__m256i *) st[i], s[i]);
+        mb_advance(jobs, n, b, ptr, nb, st);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void mb_avx512_x16(struct sha256_mb_job **jobs, int n) {
+    const uint8_t *ptr[16];
+    unsigned nb[16];
+    uint32_t st[8][SHA256_MB_MAX_LANES] __attribute__((aligned(64)));
+    unsigned maxb = mb_setup(jobs, n, 16, ptr, nb, st);
+    const __m512i bswap = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203);
+    __m512i s[8];
+    for (int i = 0; i < 8; i++) s[i] = _mm512_load_si512((const void *) st[i]);
+
+    for (unsigned b = 0; b < maxb; b++) {
+        __m512i w[16];
+        for (int t = 0; t < 16; t++) {
+            uint32_t v[16];
+            for (int l = 0; l < 16; l++) memcpy(&v[l], ptr[l] + 4 * t, 4);
+            w[t] = _mm512_shuffle_epi8(_mm512_loadu_si512((const void *) v), bswap);
+        }
+        __m512i a = s[0], bb = s[1], c = s[2], d = s[3];
+        __m512i e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i++) {
+            __m512i wi;
+            if (i < 16) {
+                wi = w[i];
+            } else {
+                __m512i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18), _mm512_srli_epi32(w15, 3), 0x96);
+                __m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19), _mm512_srli_epi32(w2, 10), 0x96);
+                wi = _mm512_add_epi32(_mm512_add_epi32(w[i & 15], s0), _mm512_add_epi32(w[(i - 7) & 15], s1));
+                w[i & 15] = wi;
+            }
+            __m512i S1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25), 0x96);
+            __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xca);
+            __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, S1), _mm512_add_epi32(ch, _mm512_add_epi32(wi, _mm512_set1_epi32(sha256_k[i]))));
+            __m512i S0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22), 0x96);
+            __m512i maj = _mm512_ternarylogic_epi32(a, bb, c, 0xe8);
+            h = g; g = f; f = e; e = _mm512_add_epi32(d, t1);
+            d = c; c = bb; bb = a; a = _mm512_add_epi32(t1, _mm512_add_epi32(S0, maj));
+        }
+        s[0] = _mm512_add_epi32(s[0], a); s[1] = _mm512_add_epi32(s[1], bb);
+        s[2] = _mm512_add_epi32(s[2], c); s[3] = _mm512_add_epi32(s[3], d);
+        s[4] = _mm512_add_epi32(s[4], e); s[5] = _mm512_add_epi32(s[5], f);
+        s[6] = _mm512_add_epi32(s[6], g); s[7] = _mm512_add_epi32(s[7], h);
+        for (int i = 0; i < 8; i++) _mm512_store_si512((void *) st[i], s[i]);
+        mb_advance(jobs, n, b, ptr, nb, st);
+    }
+}
+
+#endif /* SHA256_MB_X86 */
+
+int sha256_mb_select(enum sha256_mb_engine engine) {
+#ifdef SHA256_MB_X86
+    __builtin_cpu_init();
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#else
+    int has_avx2 = 0, has_avx512 = 0;
+#endif
+    if (engine == SHA256_MB_AUTO) {
+        int hw_kernel = sha256_kernel_current() != SHA256_KERNEL_SCALAR;
+        engine = has_avx512 ? SHA256_MB_AVX512 : has_avx2 && !hw_kernel ? SHA256_MB_AVX2 : SHA256_MB_SCALAR;
+    }
+    if ((engine == SHA256_MB_AVX2 && !has_avx2) || (engine == SHA256_MB_AVX512 && !has_avx512)) {
+        return -1;
+    }
+    mb_engine = engine;
+    mb_lanes = engine == SHA256_MB_AVX512 ? 16 : engine == SHA256_MB_AVX2 ? 8 : 1;
+    return 0;
+}
+
+int sha256_mb_parse(const char *name, enum sha256_mb_engine *engine) {
+    static const char *names[] = { "auto", "scalar", "avx2", "avx512" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *engine = (enum sha256_mb_engine) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *sha256_mb_name(void) {
+    switch (mb_engine) {
+    case SHA256_MB_AVX512: return "avx512x16";
+    case SHA256_MB_AVX2: return "avx2x8";
+    default: return "serial";
+    }
+}
+
+int sha256_mb_lanes(void) {
+    return mb_lanes;
+}
+
+static int by_length(const void *a, const void *b) {
+    unsigned x = (*(struct sha256_mb_job *const *) a)->nblocks, y = (*(struct sha256_mb_job *const *) b)->nblocks;
+    return (x > y) - (x < y);
+}
+
+void sha256_mb_run(struct sha256_mb_job *jobs, int njobs, struct sha256_mb_job **order) {
+    /* Group jobs of equal length into the same lane set so no lane idles for long */
+    for (int i = 0; i < njobs; i++) order[i] = &jobs[i];
+    qsort(order, njobs, sizeof(*order), by_length);
+    int i = 0;
+#ifdef SHA256_MB_X86
+    /* A nearly empty lane set costs as much as a full one; leave short tails to the scalar loop */
+    int min_group = mb_lanes / 4 + 1;
+    while (mb_engine != SHA256_MB_SCALAR && njobs - i >= min_group) {
+        int n = njobs - i < mb_lanes ? njobs - i : mb_lanes;
+        if (mb_engine == SHA256_MB_AVX512) mb_avx512_x16(order + i, n);
+        else mb_avx2_x8(order + i, n);
+        i += n;
+    }
+#endif
+    for (; i < njobs; i++) {
+        sha256_compress(order[i]->h, order[i]->blocks, order[i]->nblocks);
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+/*
+ * Shared-memory transport for same-host clients. After an AF_UNIX
+ * connection sends ShmAttach, the server maps a region holding two
+ * single-producer single-consumer byte rings and passes it back with two
+ * eventfds. The rings carry exactly the bytes the socket would have, framing
+ * and all; the socket itself stays open only to notice either side leaving.
+ *
+ * Each side rings the other's eventfd only when the other announced it was
+ * about to sleep, so a busy pair exchanges requests and responses without a
+ * system call. The region is writable by the peer: every index it holds is
+ * checked before use.
+ */
+
+#define SHM_ATTACH_TYPE 9       /* client: switch this connection to shared memory */
+#define SHM_ATTACHED_TYPE 10    /* server: ring size; memfd and the two eventfds ride along */
+#define SHM_RING_SIZE (1 << 20) /* bytes per direction; power of two */
+#define SHM_RING_MAX (1 << 26)
+
+struct shm_ring {
+    _Alignas(64) uint32_t head;     /* consumer position, free running */
+    _Alignas(64) uint32_t tail;     /* producer position, free running */
+};
+
+struct shm_region {
+    struct shm_ring req;            /* client -> server */
+    struct shm_ring resp;           /* server -> client */
+    _Alignas(64) uint32_t server_sleeping;
+    _Alignas(64) uint32_t client_sleeping;
+    uint32_t ring_size;
+    _Alignas(64) uint8_t data[];    /* request ring, then response ring */
+};
+
+static inline size_t shm_region_size(uint32_t ring_size) {
+    return sizeof(struct shm_region) + 2 * (size_t) ring_size;
+}
+
+/* Both sides keep their own copy of the ring size; the one in the region is only advice for the client. */
+static inline uint8_t *shm_req_data(struct shm_region *m) {
+    return m->data;
+}
+
+static inline uint8_t *shm_resp_data(struct shm_region *m, uint32_t ring_size) {
+    return m->data + ring_size;
+}
+
+/* Bytes waiting in the ring, or -1 if the indices make no sense. */
+static inline ssize_t shm_ring_used(struct shm_ring *ring, uint32_t size) {
+    uint32_t used = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return used <= size ? (ssize_t) used : -1;
+}
+
+/* Producer side: copy in as much of src as fits. Returns the bytes written or -1. */
+static inline ssize_t shm_ring_write(struct shm_ring *ring, uint8_t *data, uint32_t size, const void *src, size_t len) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (used > size) return -1;
+    size_t n = size - used < len ? size - used : len;
+    size_t at = tail & (size - 1);
+    size_t first = size - at < n ? size - at : n;
+    memcpy(data + at, src, first);
+    memcpy(data, (const uint8_t *) src + first, n - first);
+    __atomic_store_n(&ring->tail, tail + (uint32_t) n, __ATOMIC_RELEASE);
+    return (ssize_t) n;
+}
+
+/* Consumer side: copy out up to len bytes. Returns the bytes read or -1. */
+static inline ssize_t shm_ring_read(struct shm_ring *ring, const uint8_t *data, uint32_t size, void *dst, size_t len) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t used = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+    if (used > size) return -1;
+    size_t n = used < len ? used : len;
+    size_t at = head & (size - 1);
+    size_t first = size - at < n ? size - at : n;
+    memcpy(dst, data + at, first);
+    memcpy((uint8_t *) dst + first, data, n - first);
+    __atomic_store_n(&ring->head, head + (uint32_t) n, __ATOMIC_RELEASE);
+    return (ssize_t) n;
+}
+
+/*
+ * Announce that we are about to block on our eventfd. The caller must look
+ * at the rings once more afterwards: anything published before the peer saw
+ * the flag would otherwise never be rung for.
+ */
+static inline void shm_sleep(uint32_t *sleeping) {
+    __atomic_store_n(sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void shm_awake(uint32_t *sleeping) {
+    __atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/* After publishing data or freeing space: wake the peer if it is (about to be) asleep. */
+static inline void shm_wake(uint32_t *sleeping, int efd) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0) {
+            /* EAGAIN: the counter is already nonzero, so the peer wakes anyway */
+        }
+    }
+}
+
+#endif
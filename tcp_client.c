@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,23 +8,53 @@
 #include <openssl/sha.h>
 #include <time.h>
 #include <sys/select.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "histogram.h"
+#include "shm_ring.h"
 
 #define MAX_DATASIZE 224
 #define INITIALIZATION_TYPE 1
 #define ACKNOWLEDGEMENT_TYPE 2
 #define HASH_REQUEST_TYPE 3
 #define HASH_RESPONSE_TYPE 4
+#define STREAM_BEGIN_TYPE 5
+#define STREAM_DATA_TYPE 6
+#define STREAM_END_TYPE 7
+#define STREAM_DIGEST_TYPE 8
 #define SHA256_HASH_SIZE 32
 #define SA struct sockaddr
 
 struct client_arguments {
 	char ip_address[16]; /* You can store this as a string, but I probably wouldn't */
+	struct in_addr addr;
 	int port; /* is there already a structure you can store the address
 	           * and port in instead of like this? */
 	int hashnum;
 	int smin;
 	int smax;
 	char *filename; /* you can store this as a string, but I probably wouldn't */
+	int zerocopy;
+	int connections;
+	int threads;
+	int duration;
+	double rate;
+	int depth;
+	int stream;
+	char *unix_path;
+	int shm;
 };
 
 error_t client_parser(int key, char *arg, struct argp_state *state) {
@@ -33,29 +64,38 @@ error_t client_parser(int key, char *arg, struct argp_state *state) {
 	switch(key) {
 	case 'a':
 		/* validate that address parameter makes sense */
-		strncpy(args->ip_address, arg, 16);
-		if (0 /* ip address is goofytown */) {
+		strncpy(args->ip_address, arg, sizeof(args->ip_address) - 1);
+		if (inet_pton(AF_INET, arg, &args->addr) != 1) {
 			argp_error(state, "Invalid address");
 		}
 		break;
 	case 'p':
 		/* Validate that port is correct and a number, etc!! */
 		args->port = atoi(arg);
-		if (0 /* port is invalid */) {
+		if (args->port <= 0 || args->port > 65535) {
 			argp_error(state, "Invalid option for a port, must be a number");
 		}
 		break;
 	case 'n':
 		/* validate argument makes sense */
 		args->hashnum = atoi(arg);
+		if (args->hashnum < 0) {
+			argp_error(state, "Invalid number of hash requests");
+		}
 		break;
 	case 300:
 		/* validate arg */
 		args->smin = atoi(arg);
+		if (args->smin < 1 || args->smin > MAX_DATASIZE) {
+			argp_error(state, "smin must be between 1 and %d", MAX_DATASIZE);
+		}
 		break;
 	case 301:
 		/* validate arg */
 		args->smax = atoi(arg);
+		if (args->smax < 1 || args->smax > MAX_DATASIZE) {
+			argp_error(state, "smax must be between 1 and %d", MAX_DATASIZE);
+		}
 		break;
 	case 'f':
 		/* validate file */
@@ -63,6 +103,82 @@ error_t client_parser(int key, char *arg, struct argp_state *state) {
 		args->filename = malloc(len + 1);
 		strcpy(args->filename, arg);
 		break;
+	case 302:
+		args->zerocopy = 1;
+		break;
+	case 303:
+		args->connections = atoi(arg);
+		if (args->connections < 1) {
+			argp_error(state, "Invalid number of connections");
+		}
+		break;
+	case 304:
+		args->threads = atoi(arg);
+		if (args->threads < 1) {
+			argp_error(state, "Invalid number of threads");
+		}
+		break;
+	case 305:
+		args->duration = atoi(arg);
+		if (args->duration < 1) {
+			argp_error(state, "Invalid duration, must be at least 1 second");
+		}
+		break;
+	case 306:
+		args->rate = atof(arg);
+		if (args->rate <= 0) {
+			argp_error(state, "Invalid rate, must be positive");
+		}
+		break;
+	case 307:
+		args->depth = atoi(arg);
+		if (args->depth < 1 || args->depth > 65536) {
+			argp_error(state, "Invalid depth, must be between 1 and 65536");
+		}
+		break;
+	case 308:
+		args->stream = 1;
+		break;
+	case 309:
+		if (strlen(arg) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+			argp_error(state, "Socket path too long");
+		}
+		args->unix_path = arg;
+		break;
+	case 310:
+		args->shm = 1;
+		break;
+	case ARGP_KEY_END:
+		if (!args->filename) {
+			argp_error(state, "An input file is required");
+		}
+		if (!args->port && !args->unix_path) {
+			argp_error(state, "A server port is required");
+		}
+		if (args->shm && !args->unix_path) {
+			argp_error(state, "--shm needs --unix");
+		}
+		if (args->unix_path && args->zerocopy) {
+			argp_error(state, "--zerocopy needs a TCP connection");
+		}
+		if (!args->smin) args->smin = 1;
+		if (!args->smax) args->smax = MAX_DATASIZE;
+		if (args->smin > args->smax) {
+			argp_error(state, "smin must not exceed smax");
+		}
+		if (!args->connections) args->connections = 1;
+		if (!args->threads) args->threads = 1;
+		if (!args->depth) args->depth = 32;
+		if ((args->connections > 1 || args->rate > 0) && !args->duration) {
+			argp_error(state, "--connections and --rate need a --duration");
+		}
+		if (args->stream && (args->duration || args->zerocopy)) {
+			argp_error(state, "--stream cannot be combined with the load generator or --zerocopy");
+		}
+		if (args->duration && args->zerocopy) {
+			argp_error(state, "--zerocopy is not supported by the load generator");
+		}
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -79,6 +195,15 @@ struct client_arguments client_parseopt(int argc, char *argv[]) {
 		{ "smin", 300, "minsize", 0, "The minimum size for the data payload in each hash request", 0},
 		{ "smax", 301, "maxsize", 0, "The maximum size for the data payload in each hash request", 0},
 		{ "file", 'f', "file", 0, "The file that the client reads data from for all hash requests", 0},
+		{ "zerocopy", 302, 0, 0, "Send with MSG_ZEROCOPY straight out of the mapped file", 0},
+		{ "duration", 305, "S", 0, "Run as a load generator for S seconds and report throughput and latency", 0},
+		{ "connections", 303, "C", 0, "Load generator: number of connections", 0},
+		{ "threads", 304, "T", 0, "Load generator: threads the connections are spread over", 0},
+		{ "rate", 306, "R", 0, "Load generator: open loop at R requests/sec in total (default closed loop)", 0},
+		{ "stream", 308, 0, 0, "Hash the whole file as one stream and print its single digest", 0},
+		{ "depth", 307, "D", 0, "Load generator: requests in flight per connection in closed loop (default 32)", 0},
+		{ "unix", 309, "PATH", 0, "Connect to the server's AF_UNIX socket at PATH instead of TCP", 0},
+		{ "shm", 310, 0, 0, "With --unix: exchange requests and responses through shared-memory rings", 0},
 		{0}
 	};
 
@@ -96,23 +221,831 @@ struct client_arguments client_parseopt(int argc, char *argv[]) {
 
 /* -------------------------------------------------------------------------------------------------------------------------- */
 
-void chat_loop(int client_socket) {
-    char buff[MAX_DATASIZE];
-    int n;
+#define HEADER_SIZE 8
+#define RESPONSE_SIZE (HEADER_SIZE + SHA256_HASH_SIZE)
+#define SEND_BATCH 512          /* requests generated at a time */
+#define RBUF_SIZE 65536
+
+static inline void put_u32(uint8_t *b, uint32_t v) {
+    uint32_t n = htonl(v);
+    memcpy(b, &n, 4);
+}
+
+static inline uint32_t get_u32(const uint8_t *b) {
+    uint32_t n;
+    memcpy(&n, b, 4);
+    return ntohl(n);
+}
+
+/*
+ * The input file is mapped once and payload iovecs point straight into the
+ * mapping, starting over at the beginning when the end is reached.
+ */
+struct payload_source {
+    const uint8_t *base;
+    size_t size, pos;
+    int smin, smax;
+    uint64_t rng;               /* xorshift state for payload sizes */
+};
+
+static inline uint32_t source_next_len(struct payload_source *src) {
+    src->rng ^= src->rng << 13;
+    src->rng ^= src->rng >> 7;
+    src->rng ^= src->rng << 17;
+    return src->smin + (uint32_t) (src->rng % (uint64_t) (src->smax - src->smin + 1));
+}
+
+static void source_open(struct payload_source *src, const char *path, size_t min_size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        exit(1);
+    }
+    if ((size_t) st.st_size < min_size) {
+        fprintf(stderr, "Input file must hold at least %zu bytes\n", min_size);
+        exit(1);
+    }
+    src->size = st.st_size;
+    src->base = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src->base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise((void *) src->base, src->size, MADV_SEQUENTIAL);
+    close(fd);
+}
+
+/*
+ * Headers depend only on the payload length, so they come from a table that
+ * never changes. That keeps every byte we hand to the kernel immutable,
+ * which is what MSG_ZEROCOPY needs until its completion arrives.
+ */
+static uint8_t request_headers[MAX_DATASIZE + 1][HEADER_SIZE];
+static uint8_t init_header[HEADER_SIZE];
+
+static void headers_init(uint32_t n) {
+    for (uint32_t len = 0; len <= MAX_DATASIZE; len++) {
+        put_u32(request_headers[len], HASH_REQUEST_TYPE);
+        put_u32(request_headers[len] + 4, len);
+    }
+    put_u32(init_header, INITIALIZATION_TYPE);
+    put_u32(init_header + 4, n);
+}
+
+/*
+ * Where the bytes go: a socket, or with --shm the rings of a region shared
+ * with the server, set up over a local socket that afterwards only tells us
+ * when the server goes away. Both look like a non-blocking socket to the
+ * code below: sends and reads return EAGAIN when the ring is full or empty.
+ */
+struct link {
+    int fd;
+    struct shm_region *shm;
+    size_t shm_size;
+    uint32_t ring_size;
+    int wake_fd;                /* the server rings this when it published responses or made room */
+    int peer_fd;                /* we ring this */
+    int hup;                    /* the socket spoke up: the server is gone */
+};
+
+/* Swap the connection's byte stream for shared memory. Must run while the socket is still blocking. */
+static int link_attach_shm(struct link *l) {
+    uint8_t hdr[HEADER_SIZE];
+    put_u32(hdr, SHM_ATTACH_TYPE);
+    put_u32(hdr + 4, 0);
+    if (write(l->fd, hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr)) return -1;
+
+    int fds[3];
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { hdr, sizeof(hdr) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    ssize_t n = recvmsg(l->fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (n != (ssize_t) sizeof(hdr) || !cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "Server refused shared memory\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    uint32_t size = get_u32(hdr + 4);
+    if (get_u32(hdr) != SHM_ATTACHED_TYPE || size == 0 || size > SHM_RING_MAX || (size & (size - 1))) {
+        fprintf(stderr, "Bad shared memory reply from server\n");
+        return -1;
+    }
+    l->ring_size = size;
+    l->shm_size = shm_region_size(size);
+    l->shm = mmap(NULL, l->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (l->shm == MAP_FAILED) {
+        l->shm = NULL;
+        perror("mmap");
+        return -1;
+    }
+    l->peer_fd = fds[1];
+    l->wake_fd = fds[2];
+    return 0;
+}
+
+static void link_close(struct link *l) {
+    if (l->shm) {
+        munmap(l->shm, l->shm_size);
+        close(l->wake_fd);
+        close(l->peer_fd);
+    }
+    close(l->fd);
+}
+
+static ssize_t link_send(struct link *l, const struct msghdr *msg, int flags) {
+    if (!l->shm) return sendmsg(l->fd, msg, flags);
+    size_t total = 0;
+    for (size_t i = 0; i < (size_t) msg->msg_iovlen; i++) {
+        const struct iovec *v = &msg->msg_iov[i];
+        ssize_t n = shm_ring_write(&l->shm->req, shm_req_data(l->shm), l->ring_size, v->iov_base, v->iov_len);
+        if (n < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        total += n;
+        if ((size_t) n < v->iov_len) break;
+    }
+    if (!total) {
+        errno = l->hup ? EPIPE : EAGAIN;
+        return -1;
+    }
+    shm_wake(&l->shm->server_sleeping, l->peer_fd);
+    return (ssize_t) total;
+}
+
+static ssize_t link_read(struct link *l, void *buf, size_t len) {
+    if (!l->shm) return read(l->fd, buf, len);
+    ssize_t n = shm_ring_read(&l->shm->resp, shm_resp_data(l->shm, l->ring_size), l->ring_size, buf, len);
+    if (n < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (n) {
+        shm_wake(&l->shm->server_sleeping, l->peer_fd);
+        return n;
+    }
+    if (l->hup) return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+/* What the rings would let us do now, as poll events. */
+static short link_ready(struct link *l, short events) {
+    ssize_t resp = shm_ring_used(&l->shm->resp, l->ring_size);
+    ssize_t req = shm_ring_used(&l->shm->req, l->ring_size);
+    short ready = l->hup ? POLLHUP : 0;
+    if (resp < 0 || req < 0) return POLLERR;
+    if ((events & POLLIN) && resp) ready |= POLLIN;
+    if ((events & POLLOUT) && (uint32_t) req < l->ring_size) ready |= POLLOUT;
+    return ready;
+}
+
+/*
+ * Prepare to block until the rings allow events. Returns the events already
+ * possible, in which case the caller must not block; otherwise the server
+ * will ring wake_fd.
+ */
+static short link_prepare_wait(struct link *l, short events) {
+    short ready = link_ready(l, events);
+    if (ready) return ready;
+    shm_sleep(&l->shm->client_sleeping);
+    ready = link_ready(l, events);
+    if (ready) shm_awake(&l->shm->client_sleeping);
+    return ready;
+}
+
+/* After a wakeup: reset the doorbell, and notice a server that hung up. */
+static void link_woken(struct link *l) {
+    uint64_t count;
+    uint8_t b;
+    shm_awake(&l->shm->client_sleeping);
+    if (read(l->wake_fd, &count, sizeof(count)) < 0) {
+        /* EAGAIN: woken by the socket rather than the doorbell */
+    }
+    if (recv(l->fd, &b, 1, MSG_DONTWAIT | MSG_PEEK) >= 0) l->hup = 1;
+}
+
+static int64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* poll() for one link. Returns the ready events, or -1. */
+static int link_poll(struct link *l, short events) {
+    if (!l->shm) {
+        struct pollfd pfd = { .fd = l->fd, .events = events };
+        return poll(&pfd, 1, -1) < 0 ? -1 : pfd.revents;
+    }
+    short ready = link_prepare_wait(l, events);
+    if (ready) return ready;
+    struct pollfd pfd[2] = { { .fd = l->wake_fd, .events = POLLIN }, { .fd = l->fd, .events = POLLIN } };
+    if (poll(pfd, 2, -1) < 0) return -1;
+    link_woken(l);
+    return link_ready(l, events);
+}
+
+/*
+ * One sendmsg worth of requests: a header iovec and one or two payload
+ * iovecs (two when the chunk wraps around the end of the file) per request.
+ * iov_pos tracks how far a partial write has gotten.
+ */
+struct send_batch {
+    int iovcnt, iov_pos;
+    int max_reqs;
+    int zerocopy;
+    int zc_blocked;             /* ENOBUFS: no more sends until completions come back */
+    uint32_t zc_sends, zc_done, zc_copied;
+    struct iovec iov[];
+};
+
+static struct send_batch *batch_new(int max_reqs, int zerocopy) {
+    struct send_batch *b = calloc(1, sizeof(*b) + (3 * max_reqs + 1) * sizeof(struct iovec));
+    if (!b) {
+        perror("calloc");
+        exit(1);
+    }
+    b->max_reqs = max_reqs;
+    b->zerocopy = zerocopy;
+    return b;
+}
+
+/*
+ * Queue up to limit requests, continuing an Initialization of n requests of
+ * which *next have been sent. Returns the number of requests queued.
+ */
+static int batch_fill(struct send_batch *b, struct payload_source *src, uint32_t *next, uint32_t n, int limit) {
+    int i;
+    b->iovcnt = b->iov_pos = 0;
+    if (*next == 0) {
+        /* The Initialization leaves with the first requests */
+        b->iov[b->iovcnt++] = (struct iovec) { init_header, HEADER_SIZE };
+    }
+    if (limit > b->max_reqs) limit = b->max_reqs;
+    for (i = 0; i < limit && *next < n; i++, (*next)++) {
+        uint32_t len = source_next_len(src);
+        b->iov[b->iovcnt++] = (struct iovec) { request_headers[len], HEADER_SIZE };
+        size_t first = src->size - src->pos < len ? src->size - src->pos : len;
+        b->iov[b->iovcnt++] = (struct iovec) { (void *) (src->base + src->pos), first };
+        src->pos += first;
+        if (src->pos == src->size) src->pos = 0;
+        if (first < len) {
+            b->iov[b->iovcnt++] = (struct iovec) { (void *) src->base, len - first };
+            src->pos = len - first;
+        }
+    }
+    return i;
+}
+
+/* Returns -1 on a socket error, 0 otherwise. */
+static int batch_send(struct link *l, struct send_batch *b) {
+    while (b->iov_pos < b->iovcnt) {
+        int cnt = b->iovcnt - b->iov_pos;
+        struct msghdr msg = { .msg_iov = b->iov + b->iov_pos, .msg_iovlen = cnt < IOV_MAX ? cnt : IOV_MAX };
+        ssize_t n = link_send(l, &msg, b->zerocopy ? MSG_ZEROCOPY : 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            /* Too many zerocopy sends in flight: the socket stays writable, so wait for completions instead */
+            if (errno == ENOBUFS && b->zerocopy && b->zc_done < b->zc_sends) {
+                b->zc_blocked = 1;
+                return 0;
+            }
+            return -1;
+        }
+        if (b->zerocopy) b->zc_sends++;
+        while (n > 0) {
+            struct iovec *v = &b->iov[b->iov_pos];
+            if ((size_t) n >= v->iov_len) {
+                n -= v->iov_len;
+                b->iov_pos++;
+            } else {
+                v->iov_base = (uint8_t *) v->iov_base + n;
+                v->iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Drain MSG_ZEROCOPY completions from the socket error queue. Each
+ * notification covers the range of sends [ee_info, ee_data].
+ */
+static void zerocopy_reap(int fd, struct send_batch *b) {
     for (;;) {
-        bzero(buff, sizeof(buff));
-        printf("Enter the string : ");
-        n = 0;
-        while ((buff[n++] = getchar()) != '\n');
-        write(client_socket, buff, strlen(buff));
-        bzero(buff, sizeof(buff));
-        read(client_socket, buff, sizeof(buff));
-        printf("From Server : %s", buff);
-        if ((strncmp(buff, "exit", 4)) == 0) {
-            printf("Client Exit...\n");
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            uint32_t count = ee->ee_data - ee->ee_info + 1;
+            b->zc_done += count;
+            b->zc_blocked = 0;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) b->zc_copied += count;
+        }
+    }
+}
+
+/* Wait up to timeout_ms for the completions of every send so far; the kernel may still hold some. */
+static void zerocopy_drain(int fd, struct send_batch *b, int timeout_ms) {
+    int64_t deadline = mono_ns() + (int64_t) timeout_ms * 1000000;
+    zerocopy_reap(fd, b);
+    while (b->zc_done < b->zc_sends) {
+        int64_t left = deadline - mono_ns();
+        if (left <= 0) break;
+        /* Completions raise POLLERR, which poll reports whatever we ask for */
+        struct pollfd pfd = { .fd = fd };
+        if (poll(&pfd, 1, (int) ((left + 999999) / 1000000)) < 0 && errno != EINTR) break;
+        zerocopy_reap(fd, b);
+    }
+}
+
+/*
+ * Receive path: the Acknowledgement followed by HashResponses, which must
+ * arrive in the order the requests were sent.
+ */
+struct response_reader {
+    int acked;
+    uint32_t received;
+    size_t rlen;
+    uint8_t rbuf[RBUF_SIZE];
+};
+
+/* Returns -1 on a protocol error or EOF, 0 otherwise. */
+static int responses_read(struct link *l, struct response_reader *rd, uint32_t n) {
+    for (;;) {
+        ssize_t got = link_read(l, rd->rbuf + rd->rlen, RBUF_SIZE - rd->rlen);
+        if (got == 0) {
+            fprintf(stderr, "Server closed the connection after %u of %u responses\n", rd->received, n);
+            return -1;
+        }
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("read");
+            return -1;
+        }
+        rd->rlen += got;
+        size_t off = 0;
+        if (!rd->acked && rd->rlen >= HEADER_SIZE) {
+            if (get_u32(rd->rbuf) != ACKNOWLEDGEMENT_TYPE || get_u32(rd->rbuf + 4) != n * RESPONSE_SIZE) {
+                fprintf(stderr, "Bad acknowledgement from server\n");
+                return -1;
+            }
+            rd->acked = 1;
+            off = HEADER_SIZE;
+        }
+        while (rd->acked && rd->rlen - off >= RESPONSE_SIZE) {
+            const uint8_t *p = rd->rbuf + off;
+            if (get_u32(p) != HASH_RESPONSE_TYPE || get_u32(p + 4) != rd->received) {
+                fprintf(stderr, "Unexpected response for request %u\n", rd->received);
+                return -1;
+            }
+            printf("%u: 0x", rd->received);
+            for (int i = 0; i < SHA256_HASH_SIZE; i++) printf("%02x", p[HEADER_SIZE + i]);
+            printf("\n");
+            rd->received++;
+            off += RESPONSE_SIZE;
+        }
+        memmove(rd->rbuf, rd->rbuf + off, rd->rlen - off);
+        rd->rlen -= off;
+        if (rd->acked && rd->received == n) return 0;
+    }
+}
+
+/*
+ * Pipeline all n requests: keep writing batches while the socket accepts
+ * them and drain responses whenever they show up, so neither direction
+ * waits on the other.
+ */
+static int run_requests(struct link *l, struct payload_source *src, uint32_t n, int zerocopy) {
+    struct send_batch *b = batch_new(SEND_BATCH, zerocopy);
+    struct response_reader *rd = calloc(1, sizeof(*rd));
+    if (!rd) {
+        perror("malloc");
+        exit(1);
+    }
+    uint32_t next = 0;
+    int ret = 0;
+    headers_init(n);
+    batch_fill(b, src, &next, n, SEND_BATCH);
+    while (!rd->acked || rd->received < n) {
+        if (b->iov_pos == b->iovcnt && next < n) batch_fill(b, src, &next, n, SEND_BATCH);
+        int revents = link_poll(l, POLLIN | (b->iov_pos < b->iovcnt && !b->zc_blocked ? POLLOUT : 0));
+        if (revents < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            ret = -1;
+            break;
+        }
+        if (revents & POLLERR && zerocopy) {
+            zerocopy_reap(l->fd, b);
+            revents &= ~POLLERR;
+        }
+        if ((revents & POLLOUT) && batch_send(l, b) < 0) {
+            perror("sendmsg");
+            ret = -1;
             break;
         }
+        if ((revents & (POLLIN | POLLHUP | POLLERR)) && responses_read(l, rd, n) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (zerocopy) {
+        zerocopy_drain(l->fd, b, 1000);
+        fprintf(stderr, "zerocopy: %u sends, %u completed, %u fell back to copying\n",
+                b->zc_sends, b->zc_done, b->zc_copied);
+    }
+    free(b);
+    free(rd);
+    return ret;
+}
+
+/* -------------------------------------------------------------------------------------------------------------------------- */
+
+/*
+ * Stream mode: the whole input file becomes one StreamBegin, a run of
+ * StreamData chunks sent straight out of the mapping, and a StreamEnd, so
+ * the server returns a single digest of SHA256(salt || file).
+ */
+
+#define STREAM_CHUNK (1 << 20)
+
+/* Write every byte described by iov, waiting for room when the socket is full. */
+static int send_all(struct link *l, struct iovec *iov, int iovcnt) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    while (msg.msg_iovlen) {
+        ssize_t n = link_send(l, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            link_poll(l, POLLOUT);
+            continue;
+        }
+        while (msg.msg_iovlen && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int run_stream(struct link *l, const struct payload_source *src) {
+    uint8_t begin[HEADER_SIZE], end[HEADER_SIZE], data[HEADER_SIZE];
+    put_u32(begin, STREAM_BEGIN_TYPE);
+    put_u32(begin + 4, 0);
+    put_u32(end, STREAM_END_TYPE);
+    put_u32(end + 4, 0);
+    put_u32(data, STREAM_DATA_TYPE);
+
+    struct iovec iov[2] = { { begin, HEADER_SIZE } };
+    if (send_all(l, iov, 1) < 0) goto fail;
+    for (size_t pos = 0; pos < src->size; pos += STREAM_CHUNK) {
+        size_t len = src->size - pos < STREAM_CHUNK ? src->size - pos : STREAM_CHUNK;
+        put_u32(data + 4, (uint32_t) len);
+        iov[0] = (struct iovec) { data, HEADER_SIZE };
+        iov[1] = (struct iovec) { (void *) (src->base + pos), len };
+        if (send_all(l, iov, 2) < 0) goto fail;
+    }
+    iov[0] = (struct iovec) { end, HEADER_SIZE };
+    if (send_all(l, iov, 1) < 0) goto fail;
+
+    uint8_t resp[RESPONSE_SIZE];
+    size_t got = 0;
+    while (got < RESPONSE_SIZE) {
+        ssize_t n = link_read(l, resp + got, RESPONSE_SIZE - got);
+        if (n == 0) {
+            fprintf(stderr, "Server closed the connection before the digest\n");
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) goto fail;
+            link_poll(l, POLLIN);
+            continue;
+        }
+        got += n;
+    }
+    if (get_u32(resp) != STREAM_DIGEST_TYPE) {
+        fprintf(stderr, "Unexpected response to the stream\n");
+        return -1;
+    }
+    printf("stream %u (%zu bytes): 0x", get_u32(resp + 4), src->size);
+    for (int i = 0; i < SHA256_HASH_SIZE; i++) printf("%02x", resp[HEADER_SIZE + i]);
+    printf("\n");
+    return 0;
+fail:
+    perror("stream");
+    return -1;
+}
+
+/* -------------------------------------------------------------------------------------------------------------------------- */
+
+/*
+ * Load generator: C connections spread over T threads, each thread driving
+ * its connections from its own epoll loop for a fixed duration. Closed loop
+ * keeps --depth requests in flight per connection; open loop (--rate)
+ * schedules requests at fixed intervals and measures latency from the
+ * scheduled time, so a stalled server cannot hide its queueing delay.
+ */
+
+#define LG_SESSION (1u << 24)       /* requests per Initialization; 40 * N still fits the Ack */
+#define LG_MAX_INFLIGHT 65536       /* per connection; power of two */
+#define LG_SEND_BATCH 64
+#define LG_DRAIN_NS 2000000000LL
+
+struct lg_conn {
+    struct link link;
+    int dead;
+    int want_out;
+    struct send_batch *out;
+    uint32_t sent;              /* requests sent in the current Initialization */
+    struct response_reader rd;
+    uint64_t *stamps;           /* send (or scheduled) time of every request in flight */
+    uint32_t stamp_head, stamp_tail;
+    int64_t next_due;           /* open loop: scheduled time of the next request */
+};
+
+struct lg_thread {
+    pthread_t thread;
+    int id;
+    int nconns;
+    struct lg_conn *conns;
+    struct payload_source src;
+    struct histogram hist;      /* owned by this thread until it exits */
+    uint64_t completed;
+    uint64_t errors;
+    int64_t interval_ns;        /* open loop pacing per connection, 0 for closed loop */
+    int depth;
+    int64_t start, end;
+};
+
+static int lg_connect(struct link *l, const SA *servaddr, socklen_t addrlen, int shm) {
+    l->fd = socket(servaddr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (l->fd < 0) return -1;
+    if (connect(l->fd, servaddr, addrlen) != 0 || (shm && link_attach_shm(l) != 0)) {
+        close(l->fd);
+        return -1;
+    }
+    int one = 1;
+    if (servaddr->sa_family == AF_INET) setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL, 0) | O_NONBLOCK);
+    return 0;
+}
+
+/* Shared-memory connections never wait on the socket; their wait is set up before each epoll_wait. */
+static void lg_set_out(int epfd, struct lg_conn *c, int want) {
+    if (c->want_out == want) return;
+    c->want_out = want;
+    if (c->link.shm) return;
+    struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->link.fd, &ev);
+}
+
+/* Send whatever the pacing policy allows right now. */
+static void lg_send(struct lg_thread *t, int epfd, struct lg_conn *c, int64_t now) {
+    while (!c->dead) {
+        if (c->out->iov_pos < c->out->iovcnt) {
+            if (batch_send(&c->link, c->out) < 0) {
+                c->dead = 1;
+                t->errors++;
+                return;
+            }
+            if (c->out->iov_pos < c->out->iovcnt) {
+                lg_set_out(epfd, c, 1);
+                return;
+            }
+        }
+        lg_set_out(epfd, c, 0);
+        if (now >= t->end) return;
+
+        uint32_t inflight = c->stamp_head - c->stamp_tail;
+        int allowed = LG_MAX_INFLIGHT - inflight;
+        if (t->interval_ns) {
+            int64_t due = c->next_due <= now ? (now - c->next_due) / t->interval_ns + 1 : 0;
+            if (due < allowed) allowed = (int) due;
+        } else if (t->depth - (int) inflight < allowed) {
+            allowed = t->depth - (int) inflight;
+        }
+        if (allowed <= 0) return;
+
+        if (c->sent == LG_SESSION) c->sent = 0;
+        int k = batch_fill(c->out, &t->src, &c->sent, LG_SESSION, allowed);
+        for (int i = 0; i < k; i++) {
+            uint64_t stamp = (uint64_t) now;
+            if (t->interval_ns) {
+                stamp = (uint64_t) c->next_due;
+                c->next_due += t->interval_ns;
+            }
+            c->stamps[c->stamp_head++ & (LG_MAX_INFLIGHT - 1)] = stamp;
+        }
+    }
+}
+
+/* Drain responses; same framing as responses_read() but recording latency instead of printing. */
+static void lg_recv(struct lg_thread *t, struct lg_conn *c) {
+    struct response_reader *rd = &c->rd;
+    for (;;) {
+        ssize_t got = link_read(&c->link, rd->rbuf + rd->rlen, RBUF_SIZE - rd->rlen);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            c->dead = 1;
+            t->errors++;
+            return;
+        }
+        int64_t now = mono_ns();
+        rd->rlen += got;
+        size_t off = 0;
+        for (;;) {
+            if (!rd->acked) {
+                if (rd->rlen - off < HEADER_SIZE) break;
+                if (get_u32(rd->rbuf + off) != ACKNOWLEDGEMENT_TYPE) goto bad;
+                rd->acked = 1;
+                off += HEADER_SIZE;
+                continue;
+            }
+            if (rd->rlen - off < RESPONSE_SIZE) break;
+            const uint8_t *p = rd->rbuf + off;
+            if (get_u32(p) != HASH_RESPONSE_TYPE || get_u32(p + 4) != rd->received) goto bad;
+            uint64_t sent_at = c->stamps[c->stamp_tail++ & (LG_MAX_INFLIGHT - 1)];
+            histogram_record(&t->hist, (uint64_t) now > sent_at ? (uint64_t) now - sent_at : 0);
+            t->completed++;
+            off += RESPONSE_SIZE;
+            if (++rd->received == LG_SESSION) {
+                rd->received = 0;
+                rd->acked = 0;
+            }
+        }
+        memmove(rd->rbuf, rd->rbuf + off, rd->rlen - off);
+        rd->rlen -= off;
+    }
+bad:
+    fprintf(stderr, "thread %d: unexpected response, dropping connection\n", t->id);
+    c->dead = 1;
+    t->errors++;
+}
+
+static void *lg_thread_main(void *arg) {
+    struct lg_thread *t = arg;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (int i = 0; i < t->nconns; i++) {
+        struct lg_conn *c = &t->conns[i];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->link.fd, &ev);
+        if (c->link.shm) epoll_ctl(epfd, EPOLL_CTL_ADD, c->link.wake_fd, &ev);
+        /* Stagger open-loop connections so their sends don't arrive in lockstep */
+        c->next_due = t->start + (t->interval_ns ? t->interval_ns * i / t->nconns : 0);
+    }
+
+    struct epoll_event events[256];
+    for (;;) {
+        int64_t now = mono_ns();
+        int64_t wake = now >= t->end ? t->end + LG_DRAIN_NS : t->end;
+        int live = 0;
+        for (int i = 0; i < t->nconns; i++) {
+            struct lg_conn *c = &t->conns[i];
+            if (c->dead) continue;
+            /* The rings are checked on every pass; the doorbell only cuts a wait short */
+            if (c->link.shm) lg_recv(t, c);
+            lg_send(t, epfd, c, now);
+            if (t->interval_ns && c->next_due < wake) wake = c->next_due;
+            if (now < t->end || c->stamp_head != c->stamp_tail) live++;
+        }
+        if (!live || now >= t->end + LG_DRAIN_NS) break;
+        int64_t left = wake - now;
+        for (int i = 0; i < t->nconns && left > 0; i++) {
+            struct lg_conn *c = &t->conns[i];
+            if (!c->dead && c->link.shm && link_prepare_wait(&c->link, POLLIN | (c->want_out ? POLLOUT : 0))) left = 0;
+        }
+        struct timespec ts = { left > 0 ? left / 1000000000 : 0, left > 0 ? left % 1000000000 : 0 };
+        int n = epoll_pwait2(epfd, events, 256, &ts, NULL);
+        for (int i = 0; i < n; i++) {
+            struct lg_conn *c = events[i].data.ptr;
+            if (c->dead) continue;
+            if (c->link.shm) link_woken(&c->link);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) lg_recv(t, c);
+        }
     }
+    close(epfd);
+    return NULL;
+}
+
+static int run_load(const struct client_arguments *args, const struct payload_source *src,
+                    const SA *servaddr, socklen_t addrlen) {
+    int nthreads = args->threads;
+    int nconns = args->connections;
+    if (nthreads > nconns) nthreads = nconns;
+    struct lg_thread *threads = calloc(nthreads, sizeof(*threads));
+    struct histogram *total = malloc(sizeof(*total));
+    if (!threads || !total) {
+        perror("calloc");
+        exit(1);
+    }
+    headers_init(LG_SESSION);
+
+    int64_t interval = args->rate > 0 ? (int64_t) (1e9 * nconns / args->rate) : 0;
+    if (args->rate > 0 && interval == 0) interval = 1;
+    for (int i = 0; i < nthreads; i++) {
+        struct lg_thread *t = &threads[i];
+        t->id = i;
+        t->nconns = nconns / nthreads + (i < nconns % nthreads);
+        t->conns = calloc(t->nconns, sizeof(*t->conns));
+        if (!t->conns) {
+            perror("calloc");
+            exit(1);
+        }
+        t->src = *src;
+        t->src.pos = src->size / nthreads * i;
+        t->src.rng = src->rng + 0x9e3779b97f4a7c15ULL * (i + 1);
+        t->interval_ns = interval;
+        t->depth = args->depth;
+        histogram_reset(&t->hist);
+        for (int k = 0; k < t->nconns; k++) {
+            struct lg_conn *c = &t->conns[k];
+            if (lg_connect(&c->link, servaddr, addrlen, args->shm) != 0) {
+                perror("Failed to connect to server");
+                exit(1);
+            }
+            c->out = batch_new(LG_SEND_BATCH, 0);
+            c->stamps = malloc(LG_MAX_INFLIGHT * sizeof(*c->stamps));
+            if (!c->stamps) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+    }
+
+    int64_t start = mono_ns();
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].start = start;
+        threads[i].end = start + (int64_t) args->duration * 1000000000;
+        int err = pthread_create(&threads[i].thread, NULL, lg_thread_main, &threads[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    uint64_t completed = 0, errors = 0;
+    histogram_reset(total);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        histogram_merge(total, &threads[i].hist);
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+    }
+    double secs = (mono_ns() - start) / 1e9;
+
+    /* One JSON object per run, easy to diff across builds */
+    printf("{\"mode\":\"%s\",\"connections\":%d,\"threads\":%d,\"duration_s\":%d,\"target_rate\":%.0f,"
+           "\"depth\":%d,\"completed\":%llu,\"errors\":%llu,\"elapsed_s\":%.3f,\"hashes_per_sec\":%.1f,"
+           "\"latency_ns\":{\"min\":%llu,\"mean\":%.0f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+           interval ? "open" : "closed", nconns, nthreads, args->duration, args->rate,
+           interval ? 0 : args->depth, (unsigned long long) completed, (unsigned long long) errors, secs,
+           completed / secs,
+           (unsigned long long) (total->count ? total->min : 0), total->count ? (double) total->sum / total->count : 0.0,
+           (unsigned long long) histogram_percentile(total, 50), (unsigned long long) histogram_percentile(total, 90),
+           (unsigned long long) histogram_percentile(total, 99), (unsigned long long) histogram_percentile(total, 99.9),
+           (unsigned long long) histogram_percentile(total, 100));
+    fflush(stdout);
+
+    for (int i = 0; i < nthreads; i++) {
+        for (int k = 0; k < threads[i].nconns; k++) {
+            link_close(&threads[i].conns[k].link);
+            free(threads[i].conns[k].out);
+            free(threads[i].conns[k].stamps);
+        }
+        free(threads[i].conns);
+    }
+    free(threads);
+    free(total);
+    return errors ? -1 : 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -129,7 +1062,31 @@ int main(int argc, char *argv[]) {
 	printf("Got %s on port %d with n=%d smin=%d smax=%d filename=%s\n",
 	       server_ip_address, server_port, num_hashes, min_size, max_size, input_file);
 
-    int client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    struct payload_source src = { .smin = min_size, .smax = max_size };
+    /* A stream takes any non-empty file; requests need room for the largest payload */
+    source_open(&src, input_file, args.stream ? 1 : (size_t) max_size);
+    src.rng = ((uint64_t) time(NULL) << 20 ^ (uint64_t) getpid()) | 1;
+
+    struct sockaddr_in servaddr;
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(server_port);
+    servaddr.sin_addr = args.addr;
+    struct sockaddr_un localaddr;
+    bzero(&localaddr, sizeof(localaddr));
+    localaddr.sun_family = AF_UNIX;
+    if (args.unix_path) strncpy(localaddr.sun_path, args.unix_path, sizeof(localaddr.sun_path) - 1);
+    const SA *addr = args.unix_path ? (SA *) &localaddr : (SA *) &servaddr;
+    socklen_t addrlen = args.unix_path ? sizeof(localaddr) : sizeof(servaddr);
+
+    if (args.duration) {
+        int ret = run_load(&args, &src, addr, addrlen);
+        munmap((void *) src.base, src.size);
+        free(input_file);
+        return ret == 0 ? 0 : 1;
+    }
+
+    int client_socket = socket(addr->sa_family, SOCK_STREAM, 0);
 
 	/* Create */
     if (client_socket == -1) {
@@ -140,24 +1097,46 @@ int main(int argc, char *argv[]) {
         printf("Socket successfully created!\n");
     }
 
-    struct sockaddr_in servaddr;
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(server_port);
-
 	/* Connect */
-    if (connect(client_socket, (SA*)&servaddr, sizeof(servaddr)) != 0) {
+    if (connect(client_socket, addr, addrlen) != 0) {
         perror("Failed to connect to server");
         exit(1);
     }
     else {
         printf("Successfully connected to server!\n");
     }
-    
-    chat_loop(client_socket);
+    fflush(stdout);
+
+    struct link link = { .fd = client_socket };
+    if (args.shm) {
+        if (link_attach_shm(&link) != 0) exit(1);
+        printf("Switched to shared memory rings of %u KiB\n", link.ring_size / 1024);
+        fflush(stdout);
+    }
+    int one = 1;
+    if (!args.unix_path) setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) | O_NONBLOCK);
+    if (args.zerocopy && setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        perror("setsockopt(SO_ZEROCOPY)");
+        exit(1);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = args.stream ? run_stream(&link, &src) : run_requests(&link, &src, num_hashes, args.zerocopy);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fflush(stdout);
+    if (ret == 0 && args.stream) {
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        fprintf(stderr, "%zu bytes in %.3fs (%.1f MB/s)\n", src.size, secs, secs > 0 ? src.size / secs / 1e6 : 0.0);
+    } else if (ret == 0) {
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        fprintf(stderr, "%d hashes in %.3fs (%.0f hashes/sec)\n", num_hashes, secs, secs > 0 ? num_hashes / secs : 0.0);
+    }
 
 	/* Exit */
-	close(client_socket);
+	link_close(&link);
+    munmap((void *) src.base, src.size);
     if (input_file) free(input_file);
-    return 0;
+    return ret == 0 ? 0 : 1;
 }
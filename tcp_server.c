@@ -1,27 +1,52 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <argp.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <openssl/sha.h>
 #include <time.h>
 #include <sys/select.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "tcp_server.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-#define MAX_DATASIZE 224
-#define INITIALIZATION_TYPE 1
-#define ACKNOWLEDGEMENT_TYPE 2
-#define HASH_REQUEST_TYPE 3
-#define HASH_RESPONSE_TYPE 4
-#define SHA256_HASH_SIZE 32
-#define MAX 80 
 #define PORT 8080
 #define SA struct sockaddr
+#define MAX_EVENTS 256
+#define MAX_BATCH 4096
 
 struct server_arguments {
 	int port;
 	char *salt;
 	size_t salt_len;
+	int threads;
+	int pin;
+	int batch;
+	int batch_usec;
+	enum sha256_mb_engine engine;
+	enum sha256_kernel kernel;
+	enum server_backend backend;
+	int quantum;
+	int max_inflight;
+	int cache_mb;
+	char *unix_path;
+	int stats_port;
+	int stats_interval;
 };
 
 error_t server_parser(int key, char *arg, struct argp_state *state) {
@@ -40,6 +65,82 @@ error_t server_parser(int key, char *arg, struct argp_state *state) {
 		args->salt = malloc(args->salt_len+1);
 		strcpy(args->salt, arg);
 		break;
+	case 't':
+		args->threads = atoi(arg);
+		if (args->threads < 1) {
+			argp_error(state, "Invalid number of threads, must be at least 1");
+		}
+		break;
+	case 300:
+		args->pin = 1;
+		break;
+	case 301:
+		args->batch = atoi(arg);
+		if (args->batch < 1 || args->batch > MAX_BATCH) {
+			argp_error(state, "Invalid batch size, must be between 1 and %d", MAX_BATCH);
+		}
+		break;
+	case 302:
+		args->batch_usec = atoi(arg);
+		if (args->batch_usec < 0) {
+			argp_error(state, "Invalid batch deadline, must not be negative");
+		}
+		break;
+	case 303:
+		if (sha256_mb_parse(arg, &args->engine) != 0) {
+			argp_error(state, "Invalid engine, must be one of auto, scalar, avx2, avx512");
+		}
+		break;
+	case 305:
+		if (sha256_kernel_parse(arg, &args->kernel) != 0) {
+			argp_error(state, "Invalid hash kernel, must be one of auto, scalar, shani, armv8");
+		}
+		break;
+	case 306:
+		args->quantum = atoi(arg);
+		if (args->quantum < HEADER_SIZE + MAX_DATASIZE) {
+			argp_error(state, "Invalid quantum, must be at least %d bytes", HEADER_SIZE + MAX_DATASIZE);
+		}
+		break;
+	case 307:
+		args->max_inflight = atoi(arg);
+		if (args->max_inflight < 0) {
+			argp_error(state, "Invalid in-flight limit, must not be negative");
+		}
+		break;
+	case 308:
+		args->cache_mb = atoi(arg);
+		if (args->cache_mb < 0) {
+			argp_error(state, "Invalid cache size, must not be negative");
+		}
+		break;
+	case 309:
+		if (strlen(arg) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+			argp_error(state, "Socket path too long");
+		}
+		args->unix_path = arg;
+		break;
+	case 310:
+		args->stats_port = atoi(arg);
+		if (args->stats_port <= 0 || args->stats_port > 65535) {
+			argp_error(state, "Invalid stats port");
+		}
+		break;
+	case 311:
+		args->stats_interval = atoi(arg);
+		if (args->stats_interval < 0) {
+			argp_error(state, "Invalid stats interval, must not be negative");
+		}
+		break;
+	case 304:
+		if (strcmp(arg, "epoll") == 0) {
+			args->backend = BACKEND_EPOLL;
+		} else if (strcmp(arg, "io_uring") == 0) {
+			args->backend = BACKEND_IO_URING;
+		} else {
+			argp_error(state, "Invalid backend, must be epoll or io_uring");
+		}
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -54,6 +155,19 @@ struct server_arguments server_parseopt(int argc, char *argv[]) {
     struct argp_option options[] = {
         { "port", 'p', "port", 0, "The port to be used for the server", 0 },
         { "salt", 's', "salt", 0, "The salt to be used for the server", 0 },
+        { "threads", 't', "N", 0, "Number of reactor threads, each with its own SO_REUSEPORT listener", 0 },
+        { "pin", 300, 0, 0, "Pin each reactor thread to its own CPU, physical cores first", 0 },
+        { "batch", 301, "N", 0, "Maximum number of hash requests hashed together in one batch", 0 },
+        { "batch-usec", 302, "US", 0, "Hold a partial batch open for at most US microseconds (0 = flush every loop iteration)", 0 },
+        { "mb-engine", 303, "engine", 0, "Multi-buffer SHA-256 engine: auto, scalar, avx2 or avx512", 0 },
+        { "hash-kernel", 305, "kernel", 0, "Single-buffer SHA-256 kernel: auto, scalar, shani or armv8", 0 },
+        { "quantum", 306, "BYTES", 0, "Deficit round robin quantum: request bytes each connection may dispatch per round", 0 },
+        { "max-inflight", 307, "N", 0, "Most requests one connection may have waiting in a batch (0 = no limit)", 0 },
+        { "cache-mb", 308, "MB", 0, "Cache responses to repeated payloads in up to MB MiB, split across reactors (0 = off)", 0 },
+        { "backend", 304, "backend", 0, "I/O backend: epoll (default) or io_uring", 0 },
+        { "unix", 309, "PATH", 0, "Also listen on an AF_UNIX socket at PATH, which clients may switch to shared memory", 0 },
+        { "stats-port", 310, "port", 0, "Serve metrics in the Prometheus text format over HTTP on this port", 0 },
+        { "stats-interval", 311, "S", 0, "Print the metrics to stderr every S seconds (0 = never)", 0 },
         { 0 }
     };
 
@@ -64,6 +178,9 @@ struct server_arguments server_parseopt(int argc, char *argv[]) {
 
     // Default values if user doesn’t provide arguments
     if (!args.port) args.port = 8080;
+    if (!args.threads) args.threads = 1;
+    if (!args.batch) args.batch = 64;
+    if (!args.quantum) args.quantum = HEADER_SIZE + MAX_DATASIZE;
     if (!args.salt) {
         args.salt = strdup("default");
         args.salt_len = strlen(args.salt);
@@ -76,97 +193,981 @@ struct server_arguments server_parseopt(int argc, char *argv[]) {
 
 /* -------------------------------------------------------------------------------------------------------------------------- */
 
-void chat_loop(int connfd) 
-{ 
-    char buff[MAX]; 
-    int n; 
-    // infinite loop for chat 
-    for (;;) { 
-        bzero(buff, MAX); 
-  
-        // read the message from client and copy it in buffer 
-        read(connfd, buff, sizeof(buff)); 
-        // print buffer which contains the client contents 
-        printf("From client: %s\t To client : ", buff); 
-        bzero(buff, MAX); 
-        n = 0; 
-        // copy server message in the buffer 
-        while ((buff[n++] = getchar()) != '\n') 
-            ; 
-  
-        // and send that buffer to client 
-        write(connfd, buff, strlen(buff));
-  
-        // if msg contains "Exit" then server exit and chat ended. 
-        if (strncmp("exit", buff, 4) == 0) { 
-            printf("Server Exit...\n"); 
-            break; 
-        } 
-    } 
+#define COUNTER(field, help) { #field "_total", help, METRIC_COUNTER, offsetof(struct reactor_metrics, field), 0, 0, 0 }
+#define GAUGE(field, help) { #field, help, METRIC_GAUGE, offsetof(struct reactor_metrics, field), 0, 0, 0 }
+
+static const struct metric_desc reactor_metric_descs[] = {
+    COUNTER(accepted, "Connections accepted."),
+    COUNTER(closed, "Connections closed."),
+    COUNTER(dropped, "Connections dropped for a protocol violation or lack of memory."),
+    COUNTER(shed, "Connections refused because the process ran out of descriptors."),
+    { "received_bytes_total", "Bytes read from clients.", METRIC_COUNTER, offsetof(struct reactor_metrics, bytes_in), 0, 0, 0 },
+    { "sent_bytes_total", "Bytes written to clients.", METRIC_COUNTER, offsetof(struct reactor_metrics, bytes_out), 0, 0, 0 },
+    COUNTER(requests, "Hash requests answered."),
+    COUNTER(cache_hits, "Hash requests answered from the response cache."),
+    COUNTER(streams, "Streams hashed to completion."),
+    COUNTER(throttled, "Times a connection stopped being read because its client was not reading responses."),
+    COUNTER(batches, "Batches run through the multi-buffer engine."),
+    COUNTER(drr_rounds, "Deficit round robin rounds."),
+    COUNTER(inflight_stalls, "Batches flushed early because every waiting connection hit its in-flight cap."),
+    COUNTER(hash_cycles, "CPU cycles spent in the hash engine; per request, divide by requests_total."),
+    COUNTER(midstate_saved_cycles, "Estimated cycles the salt midstate spared by not hashing the salt's whole blocks again."),
+    GAUGE(connections, "Open connections."),
+    GAUGE(batch_depth, "Requests waiting in the batch."),
+    GAUGE(drr_queue, "Connections waiting for scheduler credit."),
+    { "batch_size", "Requests per batch.", METRIC_HISTOGRAM, offsetof(struct reactor_metrics, batch_size), 1, 0, 12 },
+    { "batch_wait_seconds", "Time the oldest request of a batch waited for it to run.", METRIC_HISTOGRAM,
+      offsetof(struct reactor_metrics, batch_wait_ns), 1e-9, 8, 30 },
+    { "hash_seconds", "Time spent hashing one batch.", METRIC_HISTOGRAM, offsetof(struct reactor_metrics, hash_ns), 1e-9, 8, 30 },
+};
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 }
 
-int main(int argc, char *argv[]) {
+int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t cycles_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t) now_ns();
+#endif
+}
+
+struct conn *conn_new(struct reactor *r, int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct conn *c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->fd = fd;
+    c->state = CONN_EXPECT_INIT;
+    metric_add(&r->metrics->accepted, 1);
+    c->next = r->conns;
+    if (r->conns) r->conns->prev = c;
+    r->conns = c;
+    r->nconns++;
+    return c;
+}
+
+void conn_close(struct reactor *r, struct conn *c) {
+    if (!c->closed) {
+        c->closed = 1;
+        r->nconns--;
+        metric_add(&r->metrics->closed, 1);
+        if (c->prev) c->prev->next = c->next;
+        else r->conns = c->next;
+        if (c->next) c->next->prev = c->prev;
+        r->ops->detach(r, c);
+        /* Freed by reactor_reap: events for our other descriptor may still be in this iteration's batch */
+        c->next_closing = r->closing;
+        r->closing = c;
+    }
+}
+
+/* Free the closed connections nothing refers to any more; the others wait for a later iteration. */
+static void reactor_reap(struct reactor *r) {
+    struct conn **link = &r->closing;
+    while (*link) {
+        struct conn *c = *link;
+        /* The batch, the flush or round-robin lists, or the kernel may still point at us */
+        if (c->pending || c->dirty || c->active || c->inflight) {
+            link = &c->next_closing;
+            continue;
+        }
+        *link = c->next_closing;
+        free(c->wbuf);
+        free(c->sbuf);
+        free(c->spill);
+        free(c->stream);
+        if (c->shm) shm_release(c->shm);
+        free(c);
+    }
+}
+
+static void mark_dirty(struct reactor *r, struct conn *c) {
+    if (c->dirty) return;
+    c->dirty = 1;
+    c->next_dirty = r->dirty;
+    r->dirty = c;
+}
+
+/* Join the back of the round-robin queue. */
+static void conn_activate(struct reactor *r, struct conn *c) {
+    if (c->active) return;
+    c->active = 1;
+    r->nactive++;
+    c->next_active = NULL;
+    if (r->active_tail) r->active_tail->next_active = c;
+    else r->active = c;
+    r->active_tail = c;
+}
+
+/* Response bytes queued or about to be: unsent output plus our requests still in the batch. */
+static size_t conn_backlog(const struct conn *c) {
+    return (c->wlen - c->woff) + (c->slen - c->soff) + (size_t) c->pending * RESPONSE_SIZE;
+}
+
+/*
+ * Whether to hold this write back for the responses that are about to
+ * follow it. Only under load: the batch is at least half full, so it
+ * flushes soon and the next write ends the cork. A lone request at low
+ * load goes out immediately.
+ */
+int conn_more_coming(const struct reactor *r, const struct conn *c) {
+    return c->pending && r->batch.len * 2 >= r->batch.cap;
+}
+
+/* Called by the backends after output went out; resumes a throttled connection. */
+void conn_output_drained(struct reactor *r, struct conn *c) {
+    if (c->throttled && conn_backlog(c) <= OUTPUT_LIMIT / 2) {
+        c->throttled = 0;
+        mark_dirty(r, c);
+    }
+}
+
+/* Reserve room for n more bytes at the tail of the write buffer. */
+static uint8_t *conn_wreserve(struct conn *c, size_t n) {
+    if (c->woff && c->woff == c->wlen) {
+        c->woff = c->wlen = 0;
+    }
+    if (c->wlen + n > c->wcap) {
+        if (c->woff) {
+            memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+            c->wlen -= c->woff;
+            c->woff = 0;
+        }
+        if (c->wlen + n > c->wcap) {
+            size_t cap = c->wcap ? c->wcap : 4096;
+            while (cap < c->wlen + n) cap *= 2;
+            uint8_t *p = realloc(c->wbuf, cap);
+            if (!p) return NULL;
+            c->wbuf = p;
+            c->wcap = cap;
+        }
+    }
+    uint8_t *p = c->wbuf + c->wlen;
+    c->wlen += n;
+    return p;
+}
+
+static void salt_midstate_init(struct salt_midstate *m, const char *salt, size_t salt_len) {
+    m->skipped_blocks = salt_len / SHA256_BLOCK_SIZE;
+    m->tail = (const uint8_t *) salt + m->skipped_blocks * SHA256_BLOCK_SIZE;
+    m->tail_len = salt_len % SHA256_BLOCK_SIZE;
+    memcpy(m->h, sha256_iv, sizeof(m->h));
+    sha256_compress(m->h, (const uint8_t *) salt, m->skipped_blocks);
+}
+
+/* Rough cost of one compression on this core, used to price the midstate savings. */
+static uint64_t measure_block_cycles(void) {
+    uint8_t block[SHA256_BLOCK_SIZE] = { 0 };
+    uint32_t h[8];
+    memcpy(h, sha256_iv, sizeof(h));
+    uint64_t t0 = cycles_now();
+    for (int i = 0; i < 256; i++) sha256_compress(h, block, 1);
+    return (cycles_now() - t0) / 256;
+}
+
+static int batch_init(struct batch *bt, int cap, const struct salt_midstate *m) {
+    bt->cap = cap;
+    bt->slot_size = SHA256_PADDED_SIZE(m->tail_len + MAX_DATASIZE);
+    bt->bufs = malloc(cap * bt->slot_size);
+    bt->slots = calloc(cap, sizeof(*bt->slots));
+    bt->jobs = calloc(cap, sizeof(*bt->jobs));
+    bt->order = calloc(cap, sizeof(*bt->order));
+    if (!bt->bufs || !bt->slots || !bt->jobs || !bt->order) return -1;
+    for (int i = 0; i < cap; i++) {
+        memcpy(bt->bufs + i * bt->slot_size, m->tail, m->tail_len);
+    }
+    return 0;
+}
+
+static void batch_add(struct reactor *r, struct conn *c, const uint8_t *data, uint32_t len) {
+    struct batch *bt = &r->batch;
+    if (bt->len == 0) {
+        bt->opened = now_ns();
+        bt->deadline = bt->opened + r->batch_ns;
+    }
+    uint8_t *buf = bt->bufs + bt->len * bt->slot_size;
+    size_t used = r->mid.tail_len + len;
+    memcpy(buf + r->mid.tail_len, data, len);
+    size_t full = used & ~(size_t) (SHA256_BLOCK_SIZE - 1);
+    size_t padded = full + sha256_pad(buf + full, used - full, r->salt_len + len);
+    struct sha256_mb_job *job = &bt->jobs[bt->len];
+    struct batch_slot *slot = &bt->slots[bt->len];
+    job->blocks = buf;
+    job->nblocks = padded / SHA256_BLOCK_SIZE;
+    memcpy(job->h, r->mid.h, sizeof(job->h));
+    slot->c = c;
+    slot->index = c->next_index;
+    slot->len = len;
+    slot->cached = 0;
+    if (r->cache_on) {
+        /* A hit still takes a slot, with nothing to hash, so responses keep their order */
+        slot->key = hash_cache_key(data, len);
+        const uint32_t *h = hash_cache_lookup(&r->cache, slot->key, data, len);
+        if (h) {
+            memcpy(job->h, h, sizeof(job->h));
+            job->nblocks = 0;
+            slot->cached = 1;
+            metric_add(&r->metrics->cache_hits, 1);
+        }
+    }
+    bt->len++;
+    c->pending++;
+}
+
+/*
+ * Hash everything in the batch and queue the responses. Slots are emitted
+ * in arrival order, so each connection still sees its responses in order.
+ */
+void batch_flush(struct reactor *r) {
+    struct batch *bt = &r->batch;
+    if (bt->len == 0) return;
+    int64_t start = now_ns();
+    uint64_t t0 = cycles_now();
+    sha256_mb_run(bt->jobs, bt->len, bt->order);
+    uint64_t cycles = cycles_now() - t0;
+    struct reactor_metrics *m = r->metrics;
+    metric_add(&m->hash_cycles, cycles);
+    metric_add(&m->midstate_saved_cycles, bt->len * r->mid.skipped_blocks * r->block_cycles);
+    metric_add(&m->batches, 1);
+    metric_add(&m->requests, bt->len);
+    metric_observe(&m->batch_size, bt->len);
+    metric_observe(&m->batch_wait_ns, start - bt->opened);
+    metric_observe(&m->hash_ns, now_ns() - start);
+    for (int i = 0; i < bt->len; i++) {
+        struct conn *c = bt->slots[i].c;
+        if (r->cache_on && !bt->slots[i].cached) {
+            hash_cache_insert(&r->cache, bt->slots[i].key, bt->bufs + i * bt->slot_size + r->mid.tail_len,
+                              bt->slots[i].len, bt->jobs[i].h);
+        }
+        c->pending--;
+        if (c->closed) {
+            conn_close(r, c);
+            continue;
+        }
+        uint8_t *resp = conn_wreserve(c, RESPONSE_SIZE);
+        if (!resp) {
+            conn_close(r, c);
+            continue;
+        }
+        put_u32(resp, HASH_RESPONSE_TYPE);
+        put_u32(resp + 4, bt->slots[i].index);
+        sha256_digest(bt->jobs[i].h, resp + HEADER_SIZE);
+        mark_dirty(r, c);
+    }
+    bt->len = 0;
+}
+
+/*
+ * Consume every complete frame in the receive buffer. A partial frame stays
+ * buffered until the rest of it arrives, and so does everything once the
+ * peer has OUTPUT_LIMIT bytes of responses it hasn't read yet: the receive
+ * buffer then fills up and the backend stops reading. Returns -1 on a
+ * protocol violation.
+ */
+static int conn_parse(struct reactor *r, struct conn *c) {
+    size_t off = c->rstart;
+    while (off < c->rlen) {
+        if (c->chunk_left) {
+            /* Stream data is hashed where it lies; nothing beyond rbuf is ever buffered */
+            size_t n = c->rlen - off < c->chunk_left ? c->rlen - off : c->chunk_left;
+            sha256_update(c->stream, c->rbuf + off, n);
+            c->chunk_left -= n;
+            off += n;
+            continue;
+        }
+        if (c->rlen - off < HEADER_SIZE) break;
+        if (conn_backlog(c) >= OUTPUT_LIMIT) {
+            if (!c->throttled) metric_add(&r->metrics->throttled, 1);
+            c->throttled = 1;
+            break;
+        }
+        const uint8_t *p = c->rbuf + off;
+        uint32_t type = get_u32(p);
+        uint32_t field = get_u32(p + 4);
+        if (c->state == CONN_EXPECT_INIT && type == SHM_ATTACH_TYPE) {
+            /* Local clients only, and the client waits for the reply before touching the rings */
+            if (!c->local || c->shm || c->pending || c->woff != c->wlen || c->slen || c->rlen - off != HEADER_SIZE) return -1;
+            off += HEADER_SIZE;
+            if (shm_attach(r, c) < 0) return -1;
+            continue;
+        }
+        if (c->state == CONN_EXPECT_INIT && type == STREAM_BEGIN_TYPE) {
+            if (!c->stream && !(c->stream = malloc(sizeof(*c->stream)))) return -1;
+            sha256_init(c->stream, r->mid.h, r->mid.tail, r->mid.tail_len, r->mid.skipped_blocks * SHA256_BLOCK_SIZE + r->mid.tail_len);
+            c->state = CONN_STREAM;
+            off += HEADER_SIZE;
+            continue;
+        }
+        if (c->state == CONN_STREAM) {
+            if (type == STREAM_DATA_TYPE) {
+                c->chunk_left = field;
+                off += HEADER_SIZE;
+                continue;
+            }
+            if (type != STREAM_END_TYPE) return -1;
+            /* Like an acknowledgement, the digest waits for responses still in the batch */
+            if (c->pending) break;
+            uint8_t *resp = conn_wreserve(c, RESPONSE_SIZE);
+            if (!resp) return -1;
+            put_u32(resp, STREAM_DIGEST_TYPE);
+            put_u32(resp + 4, c->streams++);
+            sha256_final(c->stream, resp + HEADER_SIZE);
+            metric_add(&r->metrics->streams, 1);
+            mark_dirty(r, c);
+            c->state = CONN_EXPECT_INIT;
+            off += HEADER_SIZE;
+            continue;
+        }
+        if (c->state == CONN_EXPECT_INIT) {
+            if (type != INITIALIZATION_TYPE) return -1;
+            /* The acknowledgement must not overtake responses still in the batch */
+            if (c->pending) break;
+            uint8_t *ack = conn_wreserve(c, HEADER_SIZE);
+            if (!ack) return -1;
+            put_u32(ack, ACKNOWLEDGEMENT_TYPE);
+            put_u32(ack + 4, field * RESPONSE_SIZE);
+            mark_dirty(r, c);
+            c->expected = field;
+            c->next_index = 0;
+            c->state = field ? CONN_EXPECT_REQUEST : CONN_EXPECT_INIT;
+            off += HEADER_SIZE;
+            continue;
+        }
+        if (type != HASH_REQUEST_TYPE || field > MAX_DATASIZE) return -1;
+        if (c->rlen - off < HEADER_SIZE + field) break;
+        /* Requests enter the batch only on credit from the round-robin scheduler */
+        if (HEADER_SIZE + field > c->deficit || (r->max_inflight && c->pending >= r->max_inflight)) {
+            size_t queued = c->rlen - off;
+            if (queued > c->max_queued) c->max_queued = queued;
+            conn_activate(r, c);
+            break;
+        }
+        c->deficit -= HEADER_SIZE + field;
+        c->admitted++;
+        if (r->batch.len == r->batch.cap) batch_flush(r);
+        batch_add(r, c, p + HEADER_SIZE, field);
+        off += HEADER_SIZE + field;
+        if (++c->next_index == c->expected) {
+            c->state = CONN_EXPECT_INIT;
+        }
+    }
+    if (off == c->rlen) {
+        c->rlen = c->rstart = 0;
+    } else if (c->active && c->rlen < RBUF_SIZE) {
+        /* Back for more credit soon; compacting on every visit would be quadratic */
+        c->rstart = off;
+    } else {
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+        c->rstart = 0;
+    }
+    /* As in DRR proper, a connection with nothing left to send keeps no credit */
+    if (!c->active) c->deficit = 0;
+    return 0;
+}
+
+int conn_process(struct reactor *r, struct conn *c) {
+    if (conn_parse(r, c) < 0) {
+        metric_add(&r->metrics->dropped, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Deficit round robin over the connections with complete requests waiting.
+ * Each visit grants quantum bytes of credit and a connection dispatches
+ * requests while their frames fit in it, so a client pipelining thousands
+ * of requests gets the same share of every batch as one sending a single
+ * request, while any share the others leave unused is still taken.
+ * Runs until no connection can dispatch anything more.
+ */
+void reactor_schedule(struct reactor *r) {
+    while (r->active) {
+        struct conn *c = r->active;
+        struct conn *end = r->active_tail;
+        int progress = 0;
+        r->active = r->active_tail = NULL;
+        r->nactive = 0;
+        r->drr_rounds++;
+        /* One round: everyone queued now gets one visit; requeued connections wait for the next */
+        for (;;) {
+            struct conn *next = c->next_active;
+            int last = c == end;
+            c->active = 0;
+            if (c->closed) {
+                conn_close(r, c);
+            } else {
+                uint64_t admitted = c->admitted;
+                c->deficit += r->quantum;
+                if (conn_process(r, c) < 0) {
+                    conn_close(r, c);
+                } else {
+                    if (c->admitted != admitted) progress = 1;
+                    if (c->active) c->deferred++;
+                    /* rbuf has room again: the backend may read more */
+                    mark_dirty(r, c);
+                }
+            }
+            if (last) break;
+            c = next;
+        }
+        /* Everyone still waiting is at its in-flight cap; only a flush frees them */
+        if (!progress && r->active) {
+            r->inflight_stalls++;
+            batch_flush(r);
+        }
+    }
+}
+
+/*
+ * Write out everything produced since the last call. Connections that
+ * stalled behind their own pending requests get to parse again now.
+ */
+static void flush_dirty(struct reactor *r) {
+    while (r->dirty) {
+        struct conn *c = r->dirty;
+        r->dirty = c->next_dirty;
+        c->dirty = 0;
+        if (c->closed) {
+            conn_close(r, c);
+            continue;
+        }
+        if ((!c->pending && conn_process(r, c) < 0) || (c->shm ? shm_service(r, c) : r->ops->flush(r, c)) < 0) {
+            conn_close(r, c);
+        }
+    }
+}
+
+/* How long the backend may block before the batch deadline; -1 for no limit. */
+int64_t reactor_wait_ns(const struct reactor *r) {
+    if (r->active) return 0;
+    if (!r->batch.len) return -1;
+    int64_t left = r->batch.deadline - now_ns();
+    return left > 0 ? left : 0;
+}
+
+/*
+ * SIGUSR1 asks every reactor for a table of its connections' queue depths,
+ * printed at the end of its next loop iteration, which the handler starts
+ * by ringing each reactor's dump_fd. It is there to check that the
+ * round robin is holding: a fair share shows up as similar deferral counts
+ * and bounded queued bytes across busy connections.
+ */
+static volatile sig_atomic_t dump_requested;
+static struct reactor *dump_reactors;
+static volatile sig_atomic_t dump_nreactors;   /* set once dump_reactors is ready */
+
+static void on_sigusr1(int sig) {
+    (void) sig;
+    int saved = errno;
+    dump_requested++;
+    uint64_t one = 1;
+    for (int i = 0; i < dump_nreactors; i++) {
+        if (write(dump_reactors[i].dump_fd, &one, sizeof(one)) < 0) {
+            /* EAGAIN: the counter is already nonzero, so the reactor wakes anyway */
+        }
+    }
+    errno = saved;
+}
+
+/* Complete requests sitting in rbuf behind the scheduler. */
+static unsigned conn_queued_requests(const struct conn *c) {
+    if (c->state != CONN_EXPECT_REQUEST || c->chunk_left) return 0;
+    unsigned n = 0;
+    size_t off = c->rstart;
+    while (c->rlen - off >= HEADER_SIZE && n < c->expected - c->next_index) {
+        uint32_t len = get_u32(c->rbuf + off + 4);
+        if (len > MAX_DATASIZE || c->rlen - off < HEADER_SIZE + len) break;
+        off += HEADER_SIZE + len;
+        n++;
+    }
+    return n;
+}
+
+static void reactor_dump(struct reactor *r) {
+    fprintf(stderr, "reactor %d: %zu connections, %llu rounds, %llu in-flight stalls\n", r->id, r->nconns,
+            (unsigned long long) r->drr_rounds, (unsigned long long) r->inflight_stalls);
+    if (r->cache_on) {
+        fprintf(stderr, "  cache: %llu hits, %llu misses, %llu inserts, %llu evictions, %zu entries\n",
+                (unsigned long long) r->cache.hits, (unsigned long long) r->cache.misses,
+                (unsigned long long) r->cache.inserts, (unsigned long long) r->cache.evictions,
+                hash_cache_capacity(&r->cache));
+    }
+    for (struct conn *c = r->conns; c; c = c->next) {
+        fprintf(stderr, "  fd %d: queued %u (%zu bytes, max %zu), in batch %d, admitted %llu, deferred %llu, deficit %u\n",
+                c->fd, conn_queued_requests(c), c->rlen - c->rstart, c->max_queued, c->pending,
+                (unsigned long long) c->admitted, (unsigned long long) c->deferred, c->deficit);
+    }
+}
+
+void reactor_end_iteration(struct reactor *r) {
+    if ((unsigned) dump_requested != r->dump_seen) {
+        r->dump_seen = dump_requested;
+        reactor_dump(r);
+    }
+    reactor_schedule(r);
+    if (r->batch.len && (r->batch_ns == 0 || now_ns() >= r->batch.deadline)) {
+        batch_flush(r);
+    }
+    flush_dirty(r);
+    reactor_reap(r);
+    struct reactor_metrics *m = r->metrics;
+    metric_set(&m->connections, r->nconns);
+    metric_set(&m->batch_depth, r->batch.len);
+    metric_set(&m->drr_queue, r->nactive);
+    metric_set(&m->drr_rounds, r->drr_rounds);
+    metric_set(&m->inflight_stalls, r->inflight_stalls);
+}
+
+/* Out of descriptors: accept and drop one connection so the backlog doesn't wedge the loop. */
+void reactor_shed(struct reactor *r, int listenfd) {
+    if (r->spare_fd < 0) return;
+    close(r->spare_fd);
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd >= 0) {
+        close(fd);
+        metric_add(&r->metrics->shed, 1);
+    }
+    r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* -------------------------------------------------------------------------------------------------------------------------- */
+
+/* epoll backend: readiness-driven read() and write() */
+
+/*
+ * Bytes one readable event may pull off a socket. A pipelining client gets
+ * through a few buffers per iteration; everyone else's requests still join
+ * the same round.
+ */
+#define READ_BUDGET (4 * RBUF_SIZE)
+
+/* Read while there is room to buffer input, write while output is queued. */
+static void conn_update_events(struct reactor *r, struct conn *c) {
+    uint32_t events = (c->rlen < RBUF_SIZE ? EPOLLIN : 0) | (c->woff < c->wlen ? EPOLLOUT : 0);
+    if (c->closed || events == c->events) return;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+/* Returns -1 if the connection is dead, 0 otherwise. */
+static int epoll_flush(struct reactor *r, struct conn *c) {
+    int flags = MSG_NOSIGNAL | (conn_more_coming(r, c) ? MSG_MORE : 0);
+    while (c->woff < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->woff += n;
+        metric_add(&r->metrics->bytes_out, n);
+    }
+    if (c->woff == c->wlen) c->woff = c->wlen = 0;
+    conn_output_drained(r, c);
+    conn_update_events(r, c);
+    return 0;
+}
+
+static void epoll_detach(struct reactor *r, struct conn *c) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->shm) epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->shm->wake_fd, NULL);
+    close(c->fd);
+}
+
+/* Doorbell events carry the connection pointer with its low bit set. */
+#define DOORBELL_TAG 1
+
+static int epoll_doorbell(struct reactor *r, struct conn *c) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = (uint8_t *) c + DOORBELL_TAG };
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->shm->wake_fd, &ev);
+}
+
+static const struct reactor_ops epoll_ops = {
+    .flush = epoll_flush,
+    .detach = epoll_detach,
+    .doorbell = epoll_doorbell,
+};
+
+/* Returns -1 if the connection should be closed. */
+static int conn_on_readable(struct reactor *r, struct conn *c) {
+    if (c->shm) {
+        /* The rings carry everything now; the socket can only say goodbye */
+        uint8_t b;
+        ssize_t n = read(c->fd, &b, 1);
+        return n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    size_t budget = READ_BUDGET;
+    while (c->rlen < RBUF_SIZE && budget) {
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->rlen += n;
+        metric_add(&r->metrics->bytes_in, n);
+        budget = (size_t) n < budget ? budget - n : 0;
+        if (conn_process(r, c) < 0) return -1;
+        /* Full of requests waiting for credit: run a round now, up to this event's read budget */
+        if (c->rlen == RBUF_SIZE && c->active && budget) reactor_schedule(r);
+    }
+    conn_update_events(r, c);
+    return 0;
+}
+
+
+
+static void reactor_accept(struct reactor *r, int listenfd) {
+    for (;;) {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if ((errno == EMFILE || errno == ENFILE) && r->spare_fd >= 0) {
+                reactor_shed(r, listenfd);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        struct conn *c = conn_new(r, fd);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->local = listenfd == r->unixfd;
+        c->events = EPOLLIN;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            conn_close(r, c);
+        }
+    }
+}
+
+static void epoll_event_loop(struct reactor *r) {
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        struct timespec ts, *tsp = NULL;
+        int64_t left = reactor_wait_ns(r);
+        if (left >= 0) {
+            ts.tv_sec = left / 1000000000;
+            ts.tv_nsec = left % 1000000000;
+            tsp = &ts;
+        }
+        int n = epoll_pwait2(r->epfd, events, MAX_EVENTS, tsp, NULL);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                exit(1);
+            }
+            n = 0;
+        }
+        for (int i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            if (!p || p == &r->unixfd) {
+                reactor_accept(r, p ? r->unixfd : r->listenfd);
+                continue;
+            }
+            if (p == &r->dump_fd) {
+                /* The dump itself happens at the end of the iteration */
+                uint64_t v;
+                if (read(r->dump_fd, &v, sizeof(v)) < 0) {}
+                continue;
+            }
+            if ((uintptr_t) p & DOORBELL_TAG) {
+                struct conn *c = (struct conn *) ((uint8_t *) p - DOORBELL_TAG);
+                if (!c->closed && shm_doorbell(r, c) < 0) conn_close(r, c);
+                continue;
+            }
+            struct conn *c = p;
+            uint32_t e = events[i].events;
+            int dead = 0;
+            if (e & EPOLLOUT) dead = epoll_flush(r, c) < 0;
+            if (!dead && (e & (EPOLLIN | EPOLLHUP | EPOLLERR))) dead = conn_on_readable(r, c) < 0;
+            if (dead) conn_close(r, c);
+        }
+        reactor_end_iteration(r);
+    }
+}
+
+static int open_listener(int port) {
+    struct sockaddr_in servaddr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket creation failed");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(1);
+    }
+
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+    if (bind(fd, (SA*)&servaddr, sizeof(servaddr)) != 0) {
+        perror("socket bind failed");
+        exit(1);
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror("listen failed");
+        exit(1);
+    }
+    return fd;
+}
+
+/* Same-host listener; a stale socket file from an earlier run is replaced. */
+static int open_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket creation failed");
+        exit(1);
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (SA*)&addr, sizeof(addr)) != 0) {
+        perror("unix socket bind failed");
+        exit(1);
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror("listen failed");
+        exit(1);
+    }
+    return fd;
+}
 
-    int connfd, len;
-    struct sockaddr_in servaddr, cli;
+/*
+ * Order the CPUs we are allowed to run on so that the first hyperthread of
+ * every physical core comes before any sibling. Returns the number of CPUs.
+ */
+static int cpu_pin_order(int *order, int max) {
+    cpu_set_t set;
+    int n = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+            if (!CPU_ISSET(cpu, &set)) continue;
+            char path[96];
+            int first = cpu;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            FILE *f = fopen(path, "r");
+            if (f) {
+                if (fscanf(f, "%d", &first) != 1) first = cpu;
+                fclose(f);
+            }
+            if ((first == cpu) == (pass == 0)) order[n++] = cpu;
+        }
+    }
+    return n;
+}
+
+static void reactor_init(struct reactor *r, int id, const struct server_arguments *args, int unixfd,
+                         struct reactor_metrics *metrics) {
+    bzero(r, sizeof(*r));
+    r->id = id;
+    r->metrics = metrics;
+    r->cpu = -1;
+    r->listenfd = open_listener(args->port);
+    r->unixfd = unixfd;
+    r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    r->dump_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->dump_fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    r->salt = args->salt;
+    r->salt_len = args->salt_len;
+    r->batch_ns = (int64_t) args->batch_usec * 1000;
+    r->quantum = args->quantum;
+    if (args->cache_mb) {
+        r->cache_on = 1;
+        if (hash_cache_init(&r->cache, (size_t) args->cache_mb * 1024 * 1024 / args->threads) != 0) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    r->max_inflight = args->max_inflight;
+    salt_midstate_init(&r->mid, args->salt, args->salt_len);
+    r->block_cycles = measure_block_cycles();
+    if (batch_init(&r->batch, args->batch, &r->mid) != 0) {
+        perror("malloc");
+        exit(1);
+    }
+
+    r->backend = args->backend;
+    if (r->backend == BACKEND_IO_URING) {
+        /* The ring is created by the thread that will drive it */
+        return;
+    }
+    r->ops = &epoll_ops;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &ev) != 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    /* Every reactor waits on the one AF_UNIX listener; EPOLLEXCLUSIVE wakes just one of them */
+    ev = (struct epoll_event) { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &r->unixfd };
+    if (unixfd >= 0 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, unixfd, &ev) != 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev = (struct epoll_event) { .events = EPOLLIN, .data.ptr = &r->dump_fd };
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->dump_fd, &ev) != 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+static void *reactor_main(void *arg) {
+    struct reactor *r = arg;
+    if (r->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) fprintf(stderr, "reactor %d: cannot pin to CPU %d: %s\n", r->id, r->cpu, strerror(err));
+    }
+    if (r->backend == BACKEND_IO_URING) {
+        if (uring_setup(r) != 0) exit(1);
+        uring_event_loop(r);
+    } else {
+        epoll_event_loop(r);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
 
     struct server_arguments args = server_parseopt(argc, argv);
 
     int port = args.port;
     char *salt = args.salt;
     size_t salt_len = args.salt_len;
+    int nthreads = args.threads;
 
 
-	printf("Server starting on 0.0.0.0:%d with salt=\"%s\" (len=%zu)\n", port, salt, salt_len);
+	printf("Server starting on 0.0.0.0:%d with salt=\"%s\" (len=%zu) threads=%d\n", port, salt, salt_len, nthreads);
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, on_sigusr1);
+    raise_fd_limit();
 
-	/* Create */
-    if (server_socket == -1) {
-        perror("socket creation failed...\n");
+    if (sha256_kernel_select(args.kernel) != 0) {
+        fprintf(stderr, "Requested SHA-256 kernel is not supported on this CPU\n");
+        exit(1);
+    }
+    if (sha256_mb_select(args.engine) != 0) {
+        fprintf(stderr, "Requested SHA-256 engine is not supported on this CPU\n");
         exit(1);
     }
-    else {
-        printf("Socket successfully created!\n");
+    printf("Using the %s backend\n", args.backend == BACKEND_IO_URING ? "io_uring" : "epoll");
+    printf("Hashing with %s engine (%s kernel), batches of up to %d requests, deadline %dus\n",
+           sha256_mb_name(), sha256_kernel_name(), args.batch, args.batch_usec);
+    if (args.cache_mb) {
+        printf("Caching responses in %d MiB (%d MiB per reactor)\n", args.cache_mb, args.cache_mb / nthreads);
     }
 
-	// assign IP, PORT 
-    servaddr.sin_family = AF_INET; 
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY); 
-    servaddr.sin_port = htons(port); 
-    
-	/* Bind */
-    if ((bind(server_socket, (SA*)&servaddr, sizeof(servaddr))) != 0) { 
-        perror("socket bind failed");
-        exit(1); 
-    } 
-    else {
-        printf("Socket successfully binded..\n");
-	}
+    /* Every reactor binds its own SO_REUSEPORT listener; the kernel spreads accepts across them */
+    struct reactor *reactors = calloc(nthreads, sizeof(*reactors));
+    if (!reactors) {
+        perror("calloc");
+        exit(1);
+    }
+    /* One cache-line aligned block per reactor, so counting never shares a line */
+    struct reactor_metrics *metrics = aligned_alloc(_Alignof(struct reactor_metrics), nthreads * sizeof(*metrics));
+    if (!metrics) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(metrics, 0, nthreads * sizeof(*metrics));
+    int unixfd = args.unix_path ? open_unix_listener(args.unix_path) : -1;
+    for (int i = 0; i < nthreads; i++) {
+        reactor_init(&reactors[i], i, &args, unixfd, &metrics[i]);
+    }
+    dump_reactors = reactors;
+    dump_nreactors = nthreads;
+    struct metrics_registry registry = {
+        .prefix = "tcp_server",
+        .descs = reactor_metric_descs,
+        .ndescs = sizeof(reactor_metric_descs) / sizeof(reactor_metric_descs[0]),
+        .blocks = metrics,
+        .stride = sizeof(*metrics),
+        .nthreads = nthreads,
+    };
+    metrics_start(&registry, args.stats_port, args.stats_interval);
+    if (args.stats_port) printf("Metrics on http://0.0.0.0:%d/metrics\n", args.stats_port);
+    printf("Server listening..\n");
+    if (args.unix_path) {
+        printf("Local clients: %s (shared memory rings of %d KiB on request)\n", args.unix_path, SHM_RING_SIZE / 1024);
+    }
+    if (reactors[0].mid.skipped_blocks) {
+        printf("Salt midstate skips %zu block(s) per request, ~%llu cycles saved per request\n",
+               reactors[0].mid.skipped_blocks,
+               (unsigned long long) (reactors[0].mid.skipped_blocks * reactors[0].block_cycles));
+    }
 
-    /* Listen */
-    if ((listen(server_socket, 5)) != 0) { 
-        printf("Listen failed...\n"); 
-        exit(1); 
-    } 
-    else {
-        printf("Server listening..\n"); 
-	}
-    len = sizeof(cli); 
-
-    /* Accept */
-    connfd = accept(server_socket, (SA*)&cli, &len); 
-    if (connfd < 0) { 
-        printf("server accept failed...\n"); 
-        exit(1); 
-    } 
-    else {
-        printf("server accept the client...\n"); 
-	}
+    if (args.pin) {
+        int order[CPU_SETSIZE];
+        int ncpus = cpu_pin_order(order, CPU_SETSIZE);
+        for (int i = 0; i < nthreads && ncpus > 0; i++) {
+            reactors[i].cpu = order[i % ncpus];
+        }
+        if (nthreads > ncpus) {
+            fprintf(stderr, "warning: %d threads but only %d usable CPUs\n", nthreads, ncpus);
+        }
+    }
+    fflush(stdout);
 
-    chat_loop(connfd);
+    for (int i = 1; i < nthreads; i++) {
+        int err = pthread_create(&reactors[i].thread, NULL, reactor_main, &reactors[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    reactor_main(&reactors[0]);
 
 	/* Exit */
-    close(connfd);
-	close(server_socket);
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        close(reactors[i].listenfd);
+        free(reactors[i].batch.bufs);
+        free(reactors[i].batch.slots);
+        free(reactors[i].batch.jobs);
+    }
+    if (unixfd >= 0) {
+        close(unixfd);
+        unlink(args.unix_path);
+    }
+    free(reactors);
+    free(metrics);
+    free(args.salt);
 }
@@ -0,0 +1,234 @@
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "sha256.h"
+#include "hash_cache.h"
+#include "shm_ring.h"
+#include "metrics.h"
+
+#define MAX_DATASIZE 224
+#define INITIALIZATION_TYPE 1
+#define ACKNOWLEDGEMENT_TYPE 2
+#define HASH_REQUEST_TYPE 3
+#define HASH_RESPONSE_TYPE 4
+/* Chunked stream of arbitrary length hashed into one digest: Begin, any number of Data, End */
+#define STREAM_BEGIN_TYPE 5
+#define STREAM_DATA_TYPE 6     /* length field counts the chunk bytes that follow */
+#define STREAM_END_TYPE 7
+#define STREAM_DIGEST_TYPE 8   /* index of the stream on this connection, then the digest */
+#define SHA256_HASH_SIZE 32
+
+#define HEADER_SIZE 8
+#define RESPONSE_SIZE (HEADER_SIZE + SHA256_HASH_SIZE)
+#define RBUF_SIZE 16384
+#define OUTPUT_LIMIT (256 * 1024)   /* queued response bytes before we stop reading a connection */
+#define SPILL_LIMIT (1024 * 1024)
+
+/* A connection that traded its socket for shared-memory rings. */
+struct shm_conn {
+    struct shm_region *region;
+    size_t size;
+    uint32_t ring_size;     /* ours; the client can scribble over the copy in the region */
+    int wake_fd;            /* the client rings this */
+    int peer_fd;            /* we ring this */
+};
+
+enum conn_state {
+    CONN_EXPECT_INIT,
+    CONN_EXPECT_REQUEST,
+    CONN_STREAM,
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    uint32_t expected;      /* N announced by the client's Initialization */
+    uint32_t next_index;    /* index of the next HashResponse */
+    uint32_t streams;       /* index of the next StreamDigest */
+    uint32_t chunk_left;    /* bytes of the current stream chunk not yet received */
+    struct sha256_ctx *stream;
+    uint32_t events;        /* epoll interest currently registered */
+    int pending;            /* requests of ours still sitting in the batch */
+    int closed;             /* socket gone, on the closing list until nothing refers to it */
+    int dirty;              /* on the reactor's flush list */
+    int inflight;           /* io_uring operations the kernel still owns */
+    int active;             /* on the reactor's round-robin list, waiting to dispatch requests */
+    uint32_t deficit;       /* DRR credit in bytes; requests cost their frame size */
+    int throttled;          /* output backlog hit OUTPUT_LIMIT; parsing waits for the peer to read */
+    int recv_armed;         /* io_uring: multishot recv outstanding */
+    int recv_paused;        /* io_uring: recv cancelled while throttled */
+    int send_more;          /* io_uring: current send carries MSG_MORE */
+    int local;              /* accepted on the AF_UNIX listener */
+    struct shm_conn *shm;   /* rings replacing the socket's byte stream, or NULL */
+    struct conn *next_dirty;
+    struct conn *next_active;
+    struct conn *next_closing;
+    struct conn *prev, *next;   /* every open connection of the reactor */
+    uint64_t admitted;      /* requests dispatched to the batch */
+    uint64_t deferred;      /* rounds that ended with requests of ours still waiting */
+    size_t max_queued;      /* most request bytes seen waiting in rbuf */
+    size_t rlen;
+    size_t rstart;          /* first unconsumed byte of rbuf */
+    uint8_t rbuf[RBUF_SIZE];
+    uint8_t *wbuf;
+    size_t wlen, woff, wcap;
+    uint8_t *sbuf;          /* io_uring: output handed to the kernel, frozen until the send completes */
+    size_t slen, soff, scap;
+    uint8_t *spill;         /* io_uring: bytes received after rbuf filled up while throttled */
+    size_t spill_len, spill_cap;
+};
+
+_Static_assert(MAX_DATASIZE <= HASH_CACHE_MAX_PAYLOAD, "cache entries must hold any request payload");
+
+struct batch_slot {
+    struct conn *c;
+    uint32_t index;
+    uint32_t len;           /* payload bytes */
+    uint64_t key;           /* response cache prehash */
+    int cached;             /* job already holds the final state; nothing to hash */
+};
+
+/*
+ * SHA-256 state after absorbing every whole block of the salt. Requests
+ * start from a copy of it and only hash the salt's last partial block.
+ */
+struct salt_midstate {
+    uint32_t h[8];
+    const uint8_t *tail;
+    size_t tail_len;
+    size_t skipped_blocks;
+};
+
+/*
+ * Hash requests collected from every connection of a reactor. Each slot
+ * buffer already holds the salt tail, so adding a request copies only its
+ * payload and padding before the whole batch goes through the multi-buffer
+ * engine at once.
+ */
+struct batch {
+    int len, cap;
+    size_t slot_size;
+    uint8_t *bufs;
+    struct batch_slot *slots;
+    struct sha256_mb_job *jobs;
+    struct sha256_mb_job **order;   /* scratch for the engine, which runs the jobs sorted by length */
+    int64_t opened;         /* monotonic ns at which the oldest request arrived */
+    int64_t deadline;       /* monotonic ns by which the oldest request must be hashed */
+};
+
+/* What a reactor reports; written only by its own thread (see metrics.h). */
+struct reactor_metrics {
+    _Alignas(64) uint64_t accepted;
+    uint64_t closed;
+    uint64_t dropped;       /* closed for a protocol violation or out of memory */
+    uint64_t shed;
+    uint64_t bytes_in, bytes_out;
+    uint64_t requests;
+    uint64_t cache_hits;
+    uint64_t streams;
+    uint64_t throttled;
+    uint64_t batches;
+    uint64_t drr_rounds, inflight_stalls;
+    uint64_t hash_cycles;   /* cycles spent inside the hash engine */
+    uint64_t midstate_saved_cycles; /* estimated cycles the salt midstate spared us */
+    uint64_t connections;   /* gauges, refreshed every loop iteration */
+    uint64_t batch_depth;
+    uint64_t drr_queue;
+    struct metrics_hist batch_size;
+    struct metrics_hist batch_wait_ns;
+    struct metrics_hist hash_ns;
+};
+
+struct reactor;
+
+/* What a reactor needs from its I/O backend. */
+struct reactor_ops {
+    /* Start writing the queued output. Returns -1 if the connection is dead. */
+    int (*flush)(struct reactor *r, struct conn *c);
+    /* Stop all I/O on the socket; the connection is being closed. */
+    void (*detach)(struct reactor *r, struct conn *c);
+    /* Start watching a shared-memory connection's doorbell. Returns -1 on failure. */
+    int (*doorbell)(struct reactor *r, struct conn *c);
+};
+
+enum server_backend {
+    BACKEND_EPOLL,
+    BACKEND_IO_URING,
+};
+
+struct uring;
+
+struct reactor {
+    int id;
+    pthread_t thread;
+    int cpu;                /* CPU to pin to, or -1 */
+    enum server_backend backend;
+    const struct reactor_ops *ops;
+    int epfd;
+    struct uring *uring;
+    int listenfd;
+    int unixfd;             /* AF_UNIX listener shared by every reactor, or -1 */
+    int spare_fd;           /* held in reserve so we can shed connections on EMFILE */
+    int dump_fd;            /* eventfd SIGUSR1 rings, so an idle reactor wakes up to dump */
+    const char *salt;
+    size_t salt_len;
+    struct salt_midstate mid;
+    struct batch batch;
+    int64_t batch_ns;       /* how long a partial batch may wait */
+    struct conn *dirty;     /* connections with output produced this iteration */
+    struct conn *active, *active_tail;  /* round-robin queue of connections with requests to dispatch */
+    size_t nactive;
+    struct conn *conns;
+    struct conn *closing;   /* closed connections, freed at the end of an iteration */
+    uint32_t quantum;       /* DRR bytes granted per connection per round */
+    int max_inflight;       /* per-connection cap on requests in the batch, 0 for none */
+    uint64_t drr_rounds;
+    uint64_t inflight_stalls;   /* batches flushed early because every waiting connection hit its cap */
+    unsigned dump_seen;
+    int cache_on;
+    struct hash_cache cache;    /* payload -> final state, private to this reactor */
+    size_t nconns;
+    struct reactor_metrics *metrics;
+    uint64_t block_cycles;  /* measured cost of one compression */
+};
+
+static inline void put_u32(uint8_t *b, uint32_t v) {
+    uint32_t n = htonl(v);
+    memcpy(b, &n, 4);
+}
+
+static inline uint32_t get_u32(const uint8_t *b) {
+    uint32_t n;
+    memcpy(&n, b, 4);
+    return ntohl(n);
+}
+
+/* tcp_server.c: protocol, batching and connection lifetime, shared by every backend */
+int64_t now_ns(void);
+struct conn *conn_new(struct reactor *r, int fd);
+void conn_close(struct reactor *r, struct conn *c);
+int conn_process(struct reactor *r, struct conn *c);
+int conn_more_coming(const struct reactor *r, const struct conn *c);
+void conn_output_drained(struct reactor *r, struct conn *c);
+void batch_flush(struct reactor *r);
+void reactor_schedule(struct reactor *r);
+void reactor_shed(struct reactor *r, int listenfd);
+int64_t reactor_wait_ns(const struct reactor *r);
+void reactor_end_iteration(struct reactor *r);
+
+/* tcp_server_shm.c */
+int shm_attach(struct reactor *r, struct conn *c);
+int shm_service(struct reactor *r, struct conn *c);
+int shm_doorbell(struct reactor *r, struct conn *c);
+void shm_release(struct shm_conn *s);
+
+/* tcp_server_uring.c */
+int uring_setup(struct reactor *r);
+void uring_event_loop(struct reactor *r);
+
+#endif
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "tcp_server.h"
+
+/*
+ * Shared-memory connections: a local client trades its socket's byte stream
+ * for two rings in a memfd we map on both sides. Requests are copied from
+ * the request ring into rbuf and responses from wbuf into the response
+ * ring, so framing, scheduling and batching are exactly what a socket gets.
+ */
+
+void shm_release(struct shm_conn *s) {
+    munmap(s->region, s->size);
+    close(s->wake_fd);
+    close(s->peer_fd);
+    free(s);
+}
+
+/* Answer ShmAttach: create the region and both doorbells and hand them to the client. */
+int shm_attach(struct reactor *r, struct conn *c) {
+    struct shm_conn *s = calloc(1, sizeof(*s));
+    if (!s) return -1;
+    s->ring_size = SHM_RING_SIZE;
+    s->size = shm_region_size(s->ring_size);
+    s->wake_fd = s->peer_fd = -1;
+    int memfd = memfd_create("tcp_server-shm", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, s->size) != 0) goto fail;
+    s->region = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (s->region == MAP_FAILED) {
+        s->region = NULL;
+        goto fail;
+    }
+    s->region->ring_size = s->ring_size;
+    s->region->server_sleeping = 1;     /* nothing to do until the client's first ring */
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->wake_fd < 0 || s->peer_fd < 0) goto fail;
+
+    uint8_t reply[HEADER_SIZE];
+    put_u32(reply, SHM_ATTACHED_TYPE);
+    put_u32(reply + 4, s->ring_size);
+    int fds[3] = { memfd, s->wake_fd, s->peer_fd };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { reply, sizeof(reply) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    /* Nothing else was ever queued on this socket, so the reply fits */
+    if (sendmsg(c->fd, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(reply)) goto fail;
+    close(memfd);
+    c->shm = s;
+    return r->ops->doorbell(r, c);
+fail:
+    if (memfd >= 0) close(memfd);
+    if (s->region) munmap(s->region, s->size);
+    if (s->wake_fd >= 0) close(s->wake_fd);
+    if (s->peer_fd >= 0) close(s->peer_fd);
+    free(s);
+    return -1;
+}
+
+/* Whether either ring lets us move something right now; -1 if the client mangled them. */
+static int shm_ready(struct conn *c) {
+    struct shm_conn *s = c->shm;
+    ssize_t req = shm_ring_used(&s->region->req, s->ring_size);
+    ssize_t resp = shm_ring_used(&s->region->resp, s->ring_size);
+    if (req < 0 || resp < 0) return -1;
+    return (req && c->rlen < RBUF_SIZE) || (c->woff < c->wlen && (uint32_t) resp < s->ring_size);
+}
+
+/*
+ * Move responses out and requests in until neither ring has anything for
+ * us, then go to sleep on the doorbell. A connection whose rbuf filled up
+ * waiting for scheduler credit is back here through the flush list once it
+ * has room. Returns -1 to close.
+ */
+int shm_service(struct reactor *r, struct conn *c) {
+    struct shm_conn *s = c->shm;
+    struct shm_region *m = s->region;
+    for (;;) {
+        int moved = 0;
+        if (c->woff < c->wlen) {
+            ssize_t n = shm_ring_write(&m->resp, shm_resp_data(m, s->ring_size), s->ring_size,
+                                       c->wbuf + c->woff, c->wlen - c->woff);
+            if (n < 0) return -1;
+            c->woff += n;
+            if (c->woff == c->wlen) c->woff = c->wlen = 0;
+            if (n) {
+                moved = 1;
+                metric_add(&r->metrics->bytes_out, n);
+                conn_output_drained(r, c);
+            }
+        }
+        if (c->rlen < RBUF_SIZE) {
+            ssize_t n = shm_ring_read(&m->req, shm_req_data(m), s->ring_size, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+            if (n < 0) return -1;
+            if (n) {
+                moved = 1;
+                metric_add(&r->metrics->bytes_in, n);
+                c->rlen += n;
+                if (conn_process(r, c) < 0) return -1;
+            }
+        }
+        if (moved) {
+            shm_wake(&m->client_sleeping, s->peer_fd);
+            continue;
+        }
+        shm_sleep(&m->server_sleeping);
+        int ready = shm_ready(c);
+        if (ready <= 0) return ready;
+        shm_awake(&m->server_sleeping);
+    }
+}
+
+/* The client rang: reset the doorbell and catch up. */
+int shm_doorbell(struct reactor *r, struct conn *c) {
+    uint64_t count;
+    if (read(c->shm->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) return -1;
+    return shm_service(r, c);
+}
@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "tcp_server.h"
+
+/*
+ * io_uring backend. Accepts come from one multishot accept, receives from
+ * one multishot recv per connection that picks buffers out of a provided
+ * buffer ring, and every send queued during an iteration is submitted in
+ * the same io_uring_enter that waits for the next completions. Framing,
+ * batching and hashing are the same code the epoll backend uses.
+ *
+ * A multishot recv keeps taking buffers whether or not we want the data,
+ * so a throttled connection cancels its recv, parks what arrives until the
+ * cancel lands in a spill buffer, and re-arms once its peer catches up.
+ * A shared-memory connection's doorbell is a multishot poll on its eventfd,
+ * and so is the reactor's SIGUSR1 dump_fd.
+ */
+
+#define URING_ENTRIES 4096
+#define BUF_GROUP 0
+#define BUF_COUNT 1024          /* power of two */
+#define BUF_SIZE 4096
+
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_RECV = 2,
+    OP_SEND = 3,
+    OP_CANCEL = 4,
+    OP_ACCEPT_LOCAL = 5,
+    OP_DOORBELL = 6,
+    OP_DUMP = 7,
+};
+
+#define OP_MASK 7ULL
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;          /* next SQE to hand out; published on submit */
+    unsigned unsubmitted;
+    struct io_uring_buf_ring *br;
+    uint8_t *bufs;
+    uint16_t br_tail;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint64_t op_tag(struct conn *c, enum uring_op op) {
+    return (uint64_t) (uintptr_t) c | op;
+}
+
+/*
+ * Submit whatever is queued and, if wait_ns is not zero, block for at least
+ * one completion or until wait_ns elapses (-1 waits forever).
+ */
+static void uring_enter(struct uring *u, int64_t wait_ns) {
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        unsigned flags = 0, min_complete = 0;
+        struct io_uring_getevents_arg arg = { 0 };
+        struct __kernel_timespec ts;
+        void *argp = NULL;
+        size_t argsz = 0;
+        if (wait_ns != 0) {
+            flags |= IORING_ENTER_GETEVENTS;
+            min_complete = 1;
+            if (wait_ns > 0) {
+                ts.tv_sec = wait_ns / 1000000000;
+                ts.tv_nsec = wait_ns % 1000000000;
+                arg.ts = (uint64_t) (uintptr_t) &ts;
+                flags |= IORING_ENTER_EXT_ARG;
+                argp = &arg;
+                argsz = sizeof(arg);
+            }
+        } else {
+            /* Still run deferred task work so completions get posted */
+            flags |= IORING_ENTER_GETEVENTS;
+        }
+        int ret = sys_io_uring_enter(u->fd, u->unsubmitted, min_complete, flags, argp, argsz);
+        if (ret >= 0) {
+            u->unsubmitted -= (unsigned) ret < u->unsubmitted ? (unsigned) ret : u->unsubmitted;
+            return;
+        }
+        if (errno == ETIME || errno == EINTR) return;
+        if (errno == EAGAIN || errno == EBUSY) {
+            /* Completion queue backed up: let the caller reap before submitting more */
+            return;
+        }
+        perror("io_uring_enter");
+        exit(1);
+    }
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sqe_tail - head >= u->sq_entries) {
+        uring_enter(u, 0);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sqe_tail - head >= u->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqe_tail++;
+    u->unsubmitted++;
+    return sqe;
+}
+
+static void buf_recycle(struct uring *u, uint16_t bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (BUF_COUNT - 1)];
+    b->addr = (uint64_t) (uintptr_t) (u->bufs + (size_t) bid * BUF_SIZE);
+    b->len = BUF_SIZE;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int arm_accept(struct reactor *r, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = op == OP_ACCEPT_LOCAL ? r->unixfd : r->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = op_tag(NULL, op);
+    return 0;
+}
+
+static int arm_recv(struct reactor *r, struct conn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = op_tag(c, OP_RECV);
+    c->inflight++;
+    c->recv_armed = 1;
+    return 0;
+}
+
+static int cancel_op(struct reactor *r, struct conn *c, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = op_tag(c, op);
+    sqe->user_data = op_tag(c, OP_CANCEL);
+    c->inflight++;
+    return 0;
+}
+
+static int arm_dump(struct reactor *r) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->dump_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = op_tag(NULL, OP_DUMP);
+    return 0;
+}
+
+static int uring_doorbell(struct reactor *r, struct conn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->shm->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = op_tag(c, OP_DOORBELL);
+    c->inflight++;
+    return 0;
+}
+
+static int submit_send(struct reactor *r, struct conn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (c->sbuf + c->soff);
+    sqe->len = c->slen - c->soff;
+    sqe->msg_flags = MSG_NOSIGNAL | (c->send_more ? MSG_MORE : 0);
+    sqe->user_data = op_tag(c, OP_SEND);
+    c->inflight++;
+    return 0;
+}
+
+static int on_data(struct reactor *r, struct conn *c, const uint8_t *data, size_t len);
+
+/* The connection is no longer throttled: replay what was parked and start receiving again. */
+static int recv_resume(struct reactor *r, struct conn *c) {
+    uint8_t *spill = c->spill;
+    size_t len = c->spill_len;
+    c->spill = NULL;
+    c->spill_len = c->spill_cap = 0;
+    int ret = on_data(r, c, spill, len);
+    free(spill);
+    if (ret < 0) return -1;
+    if (c->throttled || c->spill_len) return 0;
+    c->recv_paused = 0;
+    /* A recv that is still being cancelled re-arms itself when it ends */
+    if (!c->recv_armed && arm_recv(r, c) != 0) return -1;
+    return 0;
+}
+
+/*
+ * At most one send per connection is in flight. Output produced meanwhile
+ * accumulates in wbuf; when the send finishes the buffers swap roles, so
+ * the kernel never reads memory the protocol code is still appending to.
+ */
+static int uring_flush(struct reactor *r, struct conn *c) {
+    if (c->recv_paused && !c->throttled && recv_resume(r, c) < 0) return -1;
+    if (c->slen || c->woff == c->wlen) return 0;
+    uint8_t *buf = c->sbuf;
+    size_t cap = c->scap;
+    c->sbuf = c->wbuf;
+    c->scap = c->wcap;
+    c->soff = c->woff;
+    c->slen = c->wlen;
+    c->wbuf = buf;
+    c->wcap = cap;
+    c->woff = c->wlen = 0;
+    c->send_more = conn_more_coming(r, c);
+    return submit_send(r, c);
+}
+
+/*
+ * Shutting the socket down makes the kernel finish our outstanding socket
+ * operations; a doorbell poll has to be cancelled.
+ */
+static void uring_detach(struct reactor *r, struct conn *c) {
+    shutdown(c->fd, SHUT_RDWR);
+    if (c->shm) cancel_op(r, c, OP_DOORBELL);
+    if (!c->inflight) close(c->fd);
+}
+
+static const struct reactor_ops uring_ops = {
+    .flush = uring_flush,
+    .detach = uring_detach,
+    .doorbell = uring_doorbell,
+};
+
+/* Park bytes that arrived while throttled, and make sure no more follow. */
+static int spill(struct reactor *r, struct conn *c, const uint8_t *data, size_t len) {
+    if (c->spill_len + len > SPILL_LIMIT) return -1;
+    if (c->spill_len + len > c->spill_cap) {
+        size_t cap = c->spill_cap ? c->spill_cap : BUF_SIZE;
+        while (cap < c->spill_len + len) cap *= 2;
+        uint8_t *p = realloc(c->spill, cap);
+        if (!p) return -1;
+        c->spill = p;
+        c->spill_cap = cap;
+    }
+    memcpy(c->spill + c->spill_len, data, len);
+    c->spill_len += len;
+    if (!c->recv_paused) {
+        c->recv_paused = 1;
+        if (c->recv_armed && cancel_op(r, c, OP_RECV) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Feed received bytes through the shared framing code. Returns -1 to close. */
+static int on_data(struct reactor *r, struct conn *c, const uint8_t *data, size_t len) {
+    /* Once on shared memory the socket must stay quiet */
+    if (c->shm) return -1;
+    while (len) {
+        if (c->spill_len) return spill(r, c, data, len);
+        if (c->rlen == RBUF_SIZE) {
+            if (!c->throttled) {
+                /*
+                 * Parsing stalled on scheduler credit or behind our own
+                 * batched requests: run the scheduler and hash them now
+                 */
+                reactor_schedule(r);
+                batch_flush(r);
+                if (conn_process(r, c) < 0) return -1;
+            }
+            if (c->rlen == RBUF_SIZE) {
+                /* Only a peer that isn't reading its responses leaves rbuf full */
+                return c->throttled ? spill(r, c, data, len) : -1;
+            }
+            continue;
+        }
+        size_t n = RBUF_SIZE - c->rlen < len ? RBUF_SIZE - c->rlen : len;
+        memcpy(c->rbuf + c->rlen, data, n);
+        c->rlen += n;
+        data += n;
+        len -= n;
+        if (conn_process(r, c) < 0) return -1;
+    }
+    return 0;
+}
+
+/* An operation the kernel owned has finished; a closed connection may now go away. */
+static void op_done(struct reactor *r, struct conn *c) {
+    c->inflight--;
+    if (c->closed && !c->inflight) {
+        close(c->fd);
+        conn_close(r, c);
+    }
+}
+
+static void on_accept(struct reactor *r, const struct io_uring_cqe *cqe, enum uring_op op) {
+    if (cqe->res >= 0) {
+        struct conn *c = conn_new(r, cqe->res);
+        if (!c) {
+            close(cqe->res);
+        } else {
+            c->local = op == OP_ACCEPT_LOCAL;
+            if (arm_recv(r, c) != 0) conn_close(r, c);
+        }
+    } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+        reactor_shed(r, op == OP_ACCEPT_LOCAL ? r->unixfd : r->listenfd);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) arm_accept(r, op);
+}
+
+/* The dump itself happens at the end of the iteration. */
+static void on_dump(struct reactor *r, const struct io_uring_cqe *cqe) {
+    uint64_t v;
+    if (read(r->dump_fd, &v, sizeof(v)) < 0) {}
+    if (!(cqe->flags & IORING_CQE_F_MORE)) arm_dump(r);
+}
+
+static void on_doorbell(struct reactor *r, struct conn *c, const struct io_uring_cqe *cqe) {
+    if (!c->closed && cqe->res > 0 && shm_doorbell(r, c) < 0) conn_close(r, c);
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (!c->closed && uring_doorbell(r, c) != 0) conn_close(r, c);
+        op_done(r, c);
+    }
+}
+
+static void on_recv(struct reactor *r, struct conn *c, const struct io_uring_cqe *cqe) {
+    struct uring *u = r->uring;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0) metric_add(&r->metrics->bytes_in, cqe->res);
+        if (cqe->res > 0 && !c->closed && on_data(r, c, u->bufs + (size_t) bid * BUF_SIZE, cqe->res) < 0) {
+            conn_close(r, c);
+        }
+        buf_recycle(u, bid);
+    }
+    if (!c->closed && (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))) {
+        conn_close(r, c);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* Multishot ended, typically because the buffer ring ran dry or we cancelled it */
+        c->recv_armed = 0;
+        if (!c->closed && !c->recv_paused && arm_recv(r, c) != 0) conn_close(r, c);
+        op_done(r, c);
+    }
+}
+
+static void on_send(struct reactor *r, struct conn *c, const struct io_uring_cqe *cqe) {
+    if (!c->closed) {
+        if (cqe->res < 0) {
+            conn_close(r, c);
+        } else {
+            c->soff += cqe->res;
+            metric_add(&r->metrics->bytes_out, cqe->res);
+            conn_output_drained(r, c);
+            if (c->soff < c->slen) {
+                if (submit_send(r, c) != 0) conn_close(r, c);
+            } else {
+                c->soff = c->slen = 0;
+                if (uring_flush(r, c) != 0) conn_close(r, c);
+            }
+        }
+    }
+    op_done(r, c);
+}
+
+static void reap(struct reactor *r) {
+    struct uring *u = r->uring;
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        struct conn *c = (struct conn *) (uintptr_t) (cqe->user_data & ~OP_MASK);
+        switch (cqe->user_data & OP_MASK) {
+        case OP_ACCEPT:
+        case OP_ACCEPT_LOCAL: on_accept(r, cqe, cqe->user_data & OP_MASK); break;
+        case OP_RECV: on_recv(r, c, cqe); break;
+        case OP_SEND: on_send(r, c, cqe); break;
+        case OP_CANCEL: op_done(r, c); break;
+        case OP_DOORBELL: on_doorbell(r, c, cqe); break;
+        case OP_DUMP: on_dump(r, cqe); break;
+        }
+        head++;
+        if (head == tail) {
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int uring_setup(struct reactor *r) {
+    struct uring *u = calloc(1, sizeof(*u));
+    if (!u) {
+        perror("calloc");
+        return -1;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (u->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring: kernel too old for this backend\n");
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uint8_t *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *) (ring + p.sq_off.head);
+    u->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    u->cq_head = (unsigned *) (ring + p.cq_off.head);
+    u->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    /* SQE slots are used in ring order, so the indirection array is the identity */
+    unsigned *array = (unsigned *) (ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+    u->sqe_tail = *u->sq_tail;
+
+    /* Provided buffer ring for multishot receives */
+    u->br = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    u->bufs = malloc((size_t) BUF_COUNT * BUF_SIZE);
+    if (u->br == MAP_FAILED || !u->bufs) {
+        perror("buffer ring");
+        return -1;
+    }
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) u->br,
+        .ring_entries = BUF_COUNT,
+        .bgid = BUF_GROUP,
+    };
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        perror("io_uring_register(PBUF_RING)");
+        return -1;
+    }
+    for (uint16_t bid = 0; bid < BUF_COUNT; bid++) buf_recycle(u, bid);
+
+    r->uring = u;
+    r->ops = &uring_ops;
+    return 0;
+}
+
+void uring_event_loop(struct reactor *r) {
+    if (arm_accept(r, OP_ACCEPT) != 0 || (r->unixfd >= 0 && arm_accept(r, OP_ACCEPT_LOCAL) != 0) || arm_dump(r) != 0) {
+        fprintf(stderr, "io_uring: cannot arm accept\n");
+        exit(1);
+    }
+    for (;;) {
+        uring_enter(r->uring, reactor_wait_ns(r));
+        reap(r);
+        reactor_end_iteration(r);
+    }
+}
@@ -9,9 +9,18 @@
 #include <errno.h>
 #include <endian.h>
 #include <argp.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "sample_stats.h"
+#include "udp_proto.h"
 
-#define VERSION 7
 #define SA struct sockaddr
+#define MAX_EVENTS 256
 
 struct client_arguments {
     char ip_address[16];
@@ -19,6 +28,16 @@ struct client_arguments {
     int n_requests;
     int timeout_secs;
     int condensed;
+    int kernel_ts;
+    int window;
+    int rate;
+    int retries;
+    int rto_ms;
+    int stats;
+    int report_secs;
+    char *sample_log;
+    int clients;
+    int client_threads;
 };
 
 static error_t client_parser(int key, char *arg, struct argp_state *state) {
@@ -40,6 +59,49 @@ static error_t client_parser(int key, char *arg, struct argp_state *state) {
         case 'c':
             args->condensed = 1;
             break;
+        case 300:
+            args->kernel_ts = 1;
+            break;
+        case 301:
+            args->window = atoi(arg);
+            if (args->window < 0) argp_error(state, "Invalid window, must not be negative");
+            break;
+        case 302:
+            args->rate = atoi(arg);
+            if (args->rate < 0) argp_error(state, "Invalid rate, must not be negative");
+            break;
+        case 303:
+            args->retries = atoi(arg);
+            if (args->retries < 0 || args->retries > 100) argp_error(state, "Invalid retries, must be between 0 and 100");
+            break;
+        case 304:
+            args->rto_ms = atoi(arg);
+            if (args->rto_ms <= 0) argp_error(state, "Invalid retransmission timeout, must be positive");
+            break;
+        case 305:
+            args->stats = 1;
+            break;
+        case 306:
+            args->report_secs = atoi(arg);
+            if (args->report_secs <= 0) argp_error(state, "Invalid report interval, must be positive");
+            args->stats = 1;
+            break;
+        case 307:
+            args->sample_log = arg;
+            args->stats = 1;
+            break;
+        case 308:
+            args->clients = atoi(arg);
+            if (args->clients <= 0 || args->clients > 60000) argp_error(state, "Invalid clients, must be between 1 and 60000");
+            args->stats = 1;
+            break;
+        case 309:
+            args->client_threads = atoi(arg);
+            if (args->client_threads <= 0 || args->client_threads > 256) argp_error(state, "Invalid client threads, must be between 1 and 256");
+            break;
+        case ARGP_KEY_END:
+            if (args->clients && args->sample_log) argp_error(state, "--sample-log cannot be combined with --clients");
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -53,12 +115,25 @@ static struct client_arguments client_parseopt(int argc, char *argv[]) {
         {"num", 'n', "N", 0, "Number of requests", 0},
         {"timeout", 't', "T", 0, "Timeout (seconds, 0=forever)", 0},
         {"condensed", 'c', 0, 0, "Use condensed format", 0},
+        {"kernel-ts", 300, 0, 0, "Take send and receive times from the kernel (SO_TIMESTAMPING) instead of the clock", 0},
+        {"window", 301, "W", 0, "Keep at most W requests unanswered, sending while receiving (0 = send all first)", 0},
+        {"rate", 302, "R", 0, "With --window: send at most R requests per second (0 = unpaced)", 0},
+        {"retries", 303, "K", 0, "With --window: send an unanswered request again up to K times; its sample is marked R", 0},
+        {"rto", 304, "MS", 0, "With --window: milliseconds before a request counts as unanswered (default 500)", 0},
+        {"stats", 305, 0, 0, "Summarize samples in constant memory instead of printing one line each (implies --window 64)", 0},
+        {"report", 306, "S", 0, "With --stats: print the summary so far every S seconds", 0},
+        {"sample-log", 307, "FILE", 0, "With --stats: also append every sample to FILE as a binary record", 0},
+        {"clients", 308, "K", 0, "Run K virtual clients, each sending N requests from its own source port (implies --stats); each takes about 150 bytes per --window slot", 0},
+        {"client-threads", 309, "T", 0, "With --clients: drive them from T threads (default 4)", 0},
         {0}
     };
     struct argp argp_settings = { options, client_parser, 0, 0 };
     struct client_arguments args;
     memset(&args, 0, sizeof(args));
+    args.rto_ms = 500;
+    args.client_threads = 4;
     argp_parse(&argp_settings, argc, argv, 0, NULL, &args);
+    if (args.stats && args.window == 0) args.window = 64;
     return args;
 }
 
@@ -68,78 +143,266 @@ static inline struct timespec now_ts(void) {
     return ts;
 }
 
-static inline void put_u32(uint8_t *b, uint32_t v) {
-    uint32_t n = htonl(v);
-    memcpy(b, &n, 4);
+struct request_record {
+    uint32_t seq;           /* 0: slot unused */
+    uint64_t c_sec;
+    uint64_t c_nsec;
+    int tx_stamped;         /* c_sec/c_nsec hold the kernel's transmit time */
+    int received;
+    int sends;
+    int retransmitted;      /* answered after more than one send: which one is unknown */
+    int abandoned;          /* no longer counted in flight */
+    double theta;
+    double delta;
+};
+
+/*
+ * Requests by sequence number, in a ring: slot seq & mask. The classic mode
+ * sizes it for all N requests; the windowed mode only for those it has not
+ * settled yet, so a run of any length fits in constant memory.
+ */
+struct records {
+    struct request_record *r;
+    size_t mask;
+    int N;
+};
+
+static void records_init(struct records *recs, size_t min_slots, int N) {
+    size_t slots = 1;
+    while (slots < min_slots) slots *= 2;
+    recs->r = calloc(slots, sizeof(*recs->r));
+    if (!recs->r) {
+        perror("calloc");
+        exit(1);
+    }
+    recs->mask = slots - 1;
+    recs->N = N;
 }
 
-static inline uint32_t get_u32(const uint8_t *b) {
-    uint32_t n;
-    memcpy(&n, b, 4);
-    return ntohl(n);
+static struct request_record *record_of(const struct records *recs, uint32_t seq) {
+    if (seq < 1 || seq > (uint32_t) recs->N) return NULL;
+    struct request_record *r = &recs->r[seq & recs->mask];
+    return r->seq == seq ? r : NULL;
 }
 
-static inline void put_u64(uint8_t *b, uint64_t v) {
-    uint64_t n = htobe64(v);
-    memcpy(b, &n, 8);
+/*
+ * Every send in order, with the monotonic ns after which it counts as lost.
+ * The timeout is fixed, so the log is also ordered by deadline. Positions
+ * are absolute and the ring doubles when full; the kernel numbers transmit
+ * timestamps with the same positions (modulo 2^32).
+ */
+struct send_log {
+    uint32_t *seq;          /* NULL: no log, send k is seq k + 1 */
+    int64_t *deadline;
+    size_t mask;
+    uint64_t head, tail;
+    size_t first_slots;     /* size of the first allocation; power of two, 0 for 1024 */
+};
+
+static void log_push(struct send_log *log, uint32_t seq, int64_t deadline) {
+    if (!log->seq || log->tail - log->head > log->mask) {
+        size_t slots = log->seq ? (log->mask + 1) * 2 : log->first_slots ? log->first_slots : 1024;
+        uint32_t *seqs = malloc(slots * sizeof(*seqs));
+        int64_t *deadlines = malloc(slots * sizeof(*deadlines));
+        if (!seqs || !deadlines) {
+            perror("malloc");
+            exit(1);
+        }
+        for (uint64_t k = log->head; k < log->tail; k++) {
+            seqs[k & (slots - 1)] = log->seq[k & log->mask];
+            deadlines[k & (slots - 1)] = log->deadline[k & log->mask];
+        }
+        free(log->seq);
+        free(log->deadline);
+        log->seq = seqs;
+        log->deadline = deadlines;
+        log->mask = slots - 1;
+    }
+    log->seq[log->tail & log->mask] = seq;
+    log->deadline[log->tail & log->mask] = deadline;
+    log->tail++;
 }
 
-static inline uint64_t get_u64(const uint8_t *b) {
-    uint64_t n;
-    memcpy(&n, b, 8);
-    return be64toh(n);
+static inline int64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-struct __attribute__((__packed__)) condensed_request {
-    uint32_t seq_be;
-    uint16_t ver_be;
-    uint64_t c_sec_be;
-    uint64_t c_nsec_be;
-};
+/* The software timestamp in an SCM_TIMESTAMPING control message, if the kernel attached one. */
+static int cmsg_timestamp(struct msghdr *msg, struct timespec *ts) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_TIMESTAMPING) continue;
+        struct scm_timestamping tss;
+        memcpy(&tss, CMSG_DATA(cm), sizeof(tss));
+        if (tss.ts[0].tv_sec == 0 && tss.ts[0].tv_nsec == 0) return 0;
+        *ts = tss.ts[0];
+        return 1;
+    }
+    return 0;
+}
 
-struct __attribute__((__packed__)) condensed_response {
-    uint32_t seq_be;
-    uint16_t ver_be;
-    uint64_t c_sec_be;
-    uint64_t c_nsec_be;
-    uint64_t s_sec_be;
-    uint64_t s_nsec_be;
-};
+/*
+ * Collect transmit timestamps from the error queue. With OPT_ID the kernel
+ * numbers our sends from 0. A retransmitted request keeps no stamp: its
+ * answer could belong to either send.
+ */
+static void drain_tx_timestamps(int sockfd, const struct records *recs, const struct send_log *log) {
+    for (;;) {
+        union {
+            char buf[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + 64)];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = { .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+        struct timespec ts;
+        if (!cmsg_timestamp(&msg, &ts)) continue;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_errno != ENOMSG || ee.ee_origin != SO_EE_ORIGIN_TIMESTAMPING) continue;
+            uint32_t seq;
+            if (log->seq) {
+                uint64_t k = log->head + (uint32_t) (ee.ee_data - (uint32_t) log->head);
+                if (k >= log->tail) continue;
+                seq = log->seq[k & log->mask];
+            } else {
+                seq = ee.ee_data + 1;
+            }
+            struct request_record *r = record_of(recs, seq);
+            if (!r || r->sends != 1) continue;
+            r->c_sec = ts.tv_sec;
+            r->c_nsec = ts.tv_nsec;
+            r->tx_stamped = 1;
+        }
+    }
+}
 
-struct request_record {
-    uint64_t c_sec;
-    uint64_t c_nsec;
-    int received;
-    double theta;
-    double delta;
+static void send_request(int sockfd, struct sockaddr_in *servaddr, int seq, int condensed, struct request_record *r) {
+    socklen_t servlen = sizeof(*servaddr);
+    struct timespec t0 = now_ts();
+    struct time_request req = { (uint32_t) seq, PROTO_VERSION, (uint64_t) t0.tv_sec, (uint64_t) t0.tv_nsec };
+    uint8_t buf[REQUEST_LEN];
+    size_t len = encode_request(&req, condensed, buf);
+    sendto(sockfd, buf, len, 0, (SA *) servaddr, servlen);
+    r->seq = seq;
+    r->c_sec = t0.tv_sec;
+    r->c_nsec = t0.tv_nsec;
+    r->tx_stamped = 0;
+    r->sends++;
+}
+
+/* Where settled requests go: one printed line each, or streaming statistics and an optional binary log. */
+struct sample_sink {
+    int stats;
+    struct sample_stats *st;
+    pthread_mutex_t *lock;              /* held around st when another thread reports it */
+    struct sample_summary *client;      /* --clients: this virtual client's own share */
+    FILE *log;
 };
 
-void orchestrate_client_protocol(int sockfd, struct sockaddr_in *servaddr, int N, int timeout_seconds, int condensed) {
-    struct request_record *reqs = calloc(N + 1, sizeof(*reqs));
-    if (!reqs) {
-        perror("calloc");
-        exit(1);
+static void settle(struct sample_sink *sink, uint32_t seq, const struct request_record *r) {
+    if (!sink->stats) {
+        if (!r->received)
+            printf("%u: Dropped\n", seq);
+        else if (r->retransmitted)
+            printf("%u: %.4f %.4f R\n", seq, r->theta, r->delta);
+        else
+            printf("%u: %.4f %.4f\n", seq, r->theta, r->delta);
+        return;
     }
-    socklen_t servlen = sizeof(*servaddr);
-    for (int seq = 1; seq <= N; seq++) {
-        struct timespec t0 = now_ts();
-        if (condensed) {
-            struct condensed_request req;
-            req.seq_be = htonl((uint32_t) seq);
-            req.ver_be = htons((uint16_t) VERSION);
-            req.c_sec_be = htobe64((uint64_t) t0.tv_sec);
-            req.c_nsec_be = htobe64((uint64_t) t0.tv_nsec);
-            sendto(sockfd, &req, sizeof(req), 0, (SA *) servaddr, servlen);
+    if (sink->lock) pthread_mutex_lock(sink->lock);
+    if (r->received) {
+        sample_stats_add(sink->st, r->theta, r->delta, r->retransmitted);
+    } else {
+        sample_stats_drop(sink->st);
+    }
+    if (sink->lock) pthread_mutex_unlock(sink->lock);
+    if (sink->client) {
+        if (r->received) {
+            sample_summary_add(sink->client, r->theta, r->delta, r->retransmitted);
         } else {
-            uint8_t buf[24];
-            put_u32(buf, seq);
-            put_u32(buf + 4, VERSION);
-            put_u64(buf + 8, (uint64_t) t0.tv_sec);
-            put_u64(buf + 16, (uint64_t) t0.tv_nsec);
-            sendto(sockfd, buf, sizeof(buf), 0, (SA *) servaddr, servlen);
+            sink->client->dropped++;
+        }
+    }
+    if (sink->log) {
+        struct sample_record rec = {
+            .seq = htole32(seq),
+            .flags = htole32((r->received ? 0 : SAMPLE_DROPPED) | (r->retransmitted ? SAMPLE_RETRANSMITTED : 0)),
+            .theta_ns = (int64_t) htole64((uint64_t) llround(r->theta * 1e9)),
+            .delta_ns = (int64_t) htole64((uint64_t) llround(r->delta * 1e9)),
+        };
+        fwrite(&rec, sizeof(rec), 1, sink->log);
+    }
+}
+
+/*
+ * Read every response already queued. Returns how many requests still in
+ * flight got their first answer. With settle_now, answered requests are
+ * settled at once and their slots freed.
+ */
+static int read_responses(int sockfd, const struct records *recs, int condensed, int kernel_ts,
+                          const struct send_log *log, struct sample_sink *settle_now) {
+    int answered = 0;
+    /* A pending transmit timestamp also makes the socket readable */
+    if (kernel_ts) drain_tx_timestamps(sockfd, recs, log);
+    for (;;) {
+        uint8_t rbuf[64];
+        struct sockaddr_in from;
+        union {
+            char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { rbuf, sizeof(rbuf) };
+        struct msghdr msg = {
+            .msg_name = &from, .msg_namelen = sizeof(from), .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+        };
+        ssize_t n = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+        if (n < 0) return answered;
+        if (n == 0) continue;
+        struct timespec t2;
+        if (!kernel_ts || !cmsg_timestamp(&msg, &t2)) t2 = now_ts();
+        if (n < (ssize_t) response_len(condensed)) continue;
+        struct time_response resp;
+        decode_response(rbuf, condensed, &resp);
+        if (resp.version != PROTO_VERSION) continue;
+        uint32_t seq = resp.seq;
+        uint64_t c_sec = resp.c_sec, c_nsec = resp.c_nsec, s_sec = resp.s_sec, s_nsec = resp.s_nsec;
+        /* Out of range, already settled, or a duplicate */
+        struct request_record *r = record_of(recs, seq);
+        if (!r || r->received) continue;
+        /* The echoed T0 always belongs to the send this answers; a kernel stamp only to an only send */
+        if (r->tx_stamped) {
+            c_sec = r->c_sec;
+            c_nsec = r->c_nsec;
+        }
+        double T0 = c_sec + c_nsec / 1e9;
+        double T1 = s_sec + s_nsec / 1e9;
+        double T2 = t2.tv_sec + t2.tv_nsec / 1e9;
+        r->theta = ((T1 - T0) + (T1 - T2)) / 2.0;
+        r->delta = (T2 - T0);
+        r->received = 1;
+        r->retransmitted = r->sends > 1;
+        if (!r->abandoned) answered++;
+        if (settle_now) {
+            settle(settle_now, seq, r);
+            r->seq = 0;
         }
-        reqs[seq].c_sec = t0.tv_sec;
-        reqs[seq].c_nsec = t0.tv_nsec;
+    }
+}
+
+/* Send all N requests back to back, then collect answers until the timeout. */
+void orchestrate_client_protocol(int sockfd, struct sockaddr_in *servaddr, int N, int timeout_seconds, int condensed,
+                                 int kernel_ts, struct sample_sink *sink) {
+    struct records recs;
+    records_init(&recs, (size_t) N + 1, N);
+    struct send_log log = { 0 };
+    for (int seq = 1; seq <= N; seq++) {
+        send_request(sockfd, servaddr, seq, condensed, &recs.r[seq & recs.mask]);
+        /* Keep the error queue from overflowing its socket buffer while we send */
+        if (kernel_ts && seq % 64 == 0) drain_tx_timestamps(sockfd, &recs, &log);
     }
     int received = 0;
     time_t last_activity = time(NULL);
@@ -161,68 +424,487 @@ void orchestrate_client_protocol(int sockfd, struct sockaddr_in *servaddr, int N
             break;
         }
         if (FD_ISSET(sockfd, &rfds)) {
-            uint8_t rbuf[64];
-            struct sockaddr_in from;
-            socklen_t flen = sizeof(from);
-            ssize_t n = recvfrom(sockfd, rbuf, sizeof(rbuf), 0, (SA *) &from, &flen);
-            if (n <= 0) continue;
-            struct timespec t2 = now_ts();
-            uint32_t seq;
-            uint64_t c_sec, c_nsec, s_sec, s_nsec;
-            if (condensed) {
-                if (n < (ssize_t) sizeof(struct condensed_response)) continue;
-                const struct condensed_response *r = (const struct condensed_response *) rbuf;
-                uint16_t ver = ntohs(r->ver_be);
-                seq = ntohl(r->seq_be);
-                if (ver != VERSION || seq < 1 || seq > (uint32_t) N) continue;
-                c_sec = be64toh(r->c_sec_be);
-                c_nsec = be64toh(r->c_nsec_be);
-                s_sec = be64toh(r->s_sec_be);
-                s_nsec = be64toh(r->s_nsec_be);
-            } else {
-                if (n < 40) continue;
-                seq = get_u32(rbuf);
-                uint32_t ver = get_u32(rbuf + 4);
-                if (ver != VERSION || seq < 1 || seq > (uint32_t) N) continue;
-                c_sec = get_u64(rbuf + 8);
-                c_nsec = get_u64(rbuf + 16);
-                s_sec = get_u64(rbuf + 24);
-                s_nsec = get_u64(rbuf + 32);
+            int answered = read_responses(sockfd, &recs, condensed, kernel_ts, &log, NULL);
+            received += answered;
+            if (answered) last_activity = time(NULL);
+        }
+    }
+    for (int seq = 1; seq <= N; seq++) settle(sink, seq, &recs.r[seq & recs.mask]);
+    free(recs.r);
+}
+
+/*
+ * One windowed sender with its own socket, sequence space and pacing: at
+ * most window requests are unanswered at a time, new ones leave at most
+ * rate per second, and one unanswered for rto_ms is sent again up to
+ * retries times before it counts as dropped.
+ *
+ * A request is settled as soon as it is answered or given up on, which
+ * frees its ring slot; printed lines instead wait for every earlier one.
+ * Sending stalls while the next request's slot is still taken.
+ */
+struct window_client {
+    int sockfd;
+    uint16_t port;                  /* --clients: source port, host order */
+    struct sockaddr_in *servaddr;
+    const struct client_arguments *args;
+    struct records recs;
+    struct send_log log;
+    struct sample_sink sink;
+    int64_t next_send, last_activity;
+    int next_seq, inflight, retransmits;
+    uint32_t settled;               /* every seq up to here has been settled */
+    int64_t wake;                   /* --clients: its live entry in the timer heap; -1 once finished */
+    struct sample_summary summary;
+};
+
+/* At least min_slots request records; log_slots sizes the send log until it has to grow (0 for the default). */
+static void window_client_init(struct window_client *c, int sockfd, struct sockaddr_in *servaddr,
+                               const struct client_arguments *args, const struct sample_sink *sink, size_t min_slots,
+                               size_t log_slots) {
+    memset(c, 0, sizeof(*c));
+    c->sockfd = sockfd;
+    c->servaddr = servaddr;
+    c->args = args;
+    c->sink = *sink;
+    records_init(&c->recs, min_slots, args->n_requests);
+    c->log.first_slots = log_slots;
+    c->next_send = c->last_activity = mono_ns();
+    c->next_seq = 1;
+}
+
+/* Printed lines go out in sequence order, once everything before them is settled. */
+static void window_client_settle_in_order(struct window_client *c) {
+    if (c->sink.stats) return;
+    for (struct request_record *r; c->settled + 1 < (uint32_t) c->next_seq; c->settled++) {
+        r = &c->recs.r[(c->settled + 1) & c->recs.mask];
+        if (!r->received && !r->abandoned) break;
+        settle(&c->sink, c->settled + 1, r);
+        r->seq = 0;
+    }
+}
+
+/* Retransmit and send whatever is due by now. Returns 0 once the client is done or has timed out. */
+static int window_client_send(struct window_client *c, int64_t now) {
+    const struct client_arguments *args = c->args;
+    int N = args->n_requests;
+    if (c->next_seq > N && c->inflight == 0) return 0;
+    if (args->timeout_secs > 0 && now - c->last_activity >= (int64_t) args->timeout_secs * 1000000000) return 0;
+    int64_t rto = (int64_t) args->rto_ms * 1000000;
+    int64_t interval = args->rate > 0 ? 1000000000 / args->rate : 0;
+    struct send_log *log = &c->log;
+
+    /* Time out the oldest sends first; retransmissions pay for a pacing slot like anyone else */
+    while (log->head < log->tail && log->deadline[log->head & log->mask] <= now) {
+        uint32_t seq = log->seq[log->head & log->mask];
+        struct request_record *r = record_of(&c->recs, seq);
+        if (!r || r->received) {
+            log->head++;
+            continue;
+        }
+        if (r->sends > args->retries) {
+            log->head++;
+            r->abandoned = 1;
+            c->inflight--;      /* given up on: frees its window slot */
+            if (c->sink.stats) {
+                settle(&c->sink, seq, r);
+                r->seq = 0;
             }
-            if (!reqs[seq].received) {
-                double T0 = c_sec + c_nsec / 1e9;
-                double T1 = s_sec + s_nsec / 1e9;
-                double T2 = t2.tv_sec + t2.tv_nsec / 1e9;
-                reqs[seq].theta = ((T1 - T0) + (T1 - T2)) / 2.0;
-                reqs[seq].delta = (T2 - T0);
-                reqs[seq].received = 1;
-                received++;
+            continue;
+        }
+        if (interval && now < c->next_send) break;
+        log->head++;
+        send_request(c->sockfd, c->servaddr, seq, args->condensed, r);
+        log_push(log, seq, now + rto);
+        c->next_send = (interval && c->next_send > now - interval ? c->next_send : now) + interval;
+        c->retransmits++;
+    }
+    while (c->next_seq <= N && c->inflight < args->window && c->recs.r[c->next_seq & c->recs.mask].seq == 0 &&
+           (!interval || now >= c->next_send)) {
+        struct request_record *r = &c->recs.r[c->next_seq & c->recs.mask];
+        memset(r, 0, sizeof(*r));
+        send_request(c->sockfd, c->servaddr, c->next_seq, args->condensed, r);
+        log_push(log, c->next_seq, now + rto);
+        /* Behind schedule by more than a slot: start over rather than burst to catch up */
+        c->next_send = (interval && c->next_send > now - interval ? c->next_send : now) + interval;
+        c->next_seq++;
+        c->inflight++;
+    }
+    window_client_settle_in_order(c);
+    return 1;
+}
+
+/* When window_client_send next has work, unless an answer arrives first. */
+static int64_t window_client_wake(const struct window_client *c, int64_t now) {
+    const struct client_arguments *args = c->args;
+    const struct send_log *log = &c->log;
+    int64_t wake = log->head < log->tail ? log->deadline[log->head & log->mask] : now + 1000000000;
+    /* A retransmission already due is only waiting for its pacing slot */
+    if (args->rate > 0 && (wake <= now || (c->next_seq <= args->n_requests && c->inflight < args->window &&
+                                           c->next_send < wake))) {
+        wake = c->next_send;
+    }
+    if (args->timeout_secs > 0 && c->last_activity + (int64_t) args->timeout_secs * 1000000000 < wake) {
+        wake = c->last_activity + (int64_t) args->timeout_secs * 1000000000;
+    }
+    return wake;
+}
+
+static void window_client_receive(struct window_client *c) {
+    int answered = read_responses(c->sockfd, &c->recs, c->args->condensed, c->args->kernel_ts, &c->log,
+                                  c->sink.stats ? &c->sink : NULL);
+    c->inflight -= answered;
+    if (answered) c->last_activity = mono_ns();
+    window_client_settle_in_order(c);
+}
+
+/* Settle whatever is left, which timed out with the whole run or was never sent, and free the client. */
+static void window_client_finish(struct window_client *c) {
+    struct request_record none = { 0 };
+    if (c->sink.stats) {
+        for (size_t i = 0; i <= c->recs.mask; i++) {
+            if (c->recs.r[i].seq) settle(&c->sink, c->recs.r[i].seq, &c->recs.r[i]);
+        }
+        c->settled = c->next_seq - 1;
+    }
+    for (uint32_t seq = c->settled + 1; seq <= (uint32_t) c->args->n_requests; seq++) {
+        struct request_record *r = record_of(&c->recs, seq);
+        settle(&c->sink, seq, r ? r : &none);
+    }
+    free(c->log.seq);
+    free(c->log.deadline);
+    free(c->recs.r);
+}
+
+/* Overlap sending and receiving on one socket. */
+void orchestrate_windowed_protocol(int sockfd, struct sockaddr_in *servaddr, const struct client_arguments *args,
+                                   struct sample_sink *sink) {
+    struct window_client c;
+    window_client_init(&c, sockfd, servaddr, args, sink, (size_t) args->window * 4 > 65536 ? (size_t) args->window * 4 : 65536, 0);
+    int64_t report = (int64_t) args->report_secs * 1000000000;
+    int64_t started = c.next_send, next_report = started + report;
+    for (;;) {
+        int64_t now = mono_ns();
+        if (!window_client_send(&c, now)) break;
+        int64_t wake = window_client_wake(&c, now);
+        if (report && next_report < wake) wake = next_report;
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sockfd, &rfds);
+        int64_t wait = wake > now ? wake - now : 0;
+        struct timeval tv = { wait / 1000000000, wait % 1000000000 / 1000 };
+        int rv = select(sockfd + 1, &rfds, NULL, NULL, &tv);
+        if (rv < 0 && errno != EINTR) break;
+        if (rv > 0) window_client_receive(&c);
+        if (report && mono_ns() >= next_report) {
+            char label[32];
+            snprintf(label, sizeof(label), "[%.1fs] ", (mono_ns() - started) / 1e9);
+            sample_stats_report(sink->st, stdout, label);
+            fflush(stdout);
+            next_report += report;
+        }
+    }
+    window_client_finish(&c);
+    if (c.retransmits) fprintf(stderr, "%d retransmissions\n", c.retransmits);
+}
+
+/* Wakeups of the virtual clients of one thread, earliest first. Superseded entries stay until they come up. */
+struct timer {
+    int64_t when;
+    int client;
+};
+
+struct timer_heap {
+    struct timer *t;
+    size_t len, cap;
+};
+
+static void heap_push(struct timer_heap *h, int64_t when, int client) {
+    if (h->len == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 1024;
+        h->t = realloc(h->t, h->cap * sizeof(*h->t));
+        if (!h->t) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    size_t i = h->len++;
+    for (; i > 0 && h->t[(i - 1) / 2].when > when; i = (i - 1) / 2) h->t[i] = h->t[(i - 1) / 2];
+    h->t[i] = (struct timer) { when, client };
+}
+
+static struct timer heap_pop(struct timer_heap *h) {
+    struct timer top = h->t[0], last = h->t[--h->len];
+    size_t i = 0;
+    for (size_t child; (child = 2 * i + 1) < h->len; i = child) {
+        if (child + 1 < h->len && h->t[child + 1].when < h->t[child].when) child++;
+        if (h->t[child].when >= last.when) break;
+        h->t[i] = h->t[child];
+    }
+    h->t[i] = last;
+    return top;
+}
+
+struct run_state {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int running;                    /* threads with clients left */
+};
+
+/* A slice of the --clients virtual clients, run by one thread. */
+struct client_thread {
+    pthread_t thread;
+    struct window_client *clients;
+    int nclients;
+    struct sample_stats st;         /* every sample of its clients, under lock */
+    pthread_mutex_t lock;
+    struct run_state *run;
+};
+
+static void *client_thread_main(void *arg) {
+    struct client_thread *t = arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct timer_heap heap = { 0 };
+    int64_t now = mono_ns();
+    for (int i = 0; i < t->nclients; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, t->clients[i].sockfd, &ev) != 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        t->clients[i].wake = now;
+        heap_push(&heap, now, i);
+    }
+    int running = t->nclients;
+    struct epoll_event events[MAX_EVENTS];
+    while (running > 0) {
+        now = mono_ns();
+        while (heap.len && heap.t[0].when <= now) {
+            struct timer due = heap_pop(&heap);
+            struct window_client *c = &t->clients[due.client];
+            if (c->wake != due.when) continue;
+            if (!window_client_send(c, now)) {
+                window_client_finish(c);
+                close(c->sockfd);
+                c->wake = -1;
+                running--;
+                continue;
+            }
+            c->wake = window_client_wake(c, now);
+            heap_push(&heap, c->wake, due.client);
+        }
+        if (running == 0) break;
+        struct timespec ts, *tsp = NULL;
+        if (heap.len) {
+            int64_t left = heap.t[0].when > now ? heap.t[0].when - now : 0;
+            ts.tv_sec = left / 1000000000;
+            ts.tv_nsec = left % 1000000000;
+            tsp = &ts;
+        }
+        int n = epoll_pwait2(epfd, events, MAX_EVENTS, tsp, NULL);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                exit(1);
+            }
+            n = 0;
+        }
+        now = mono_ns();
+        for (int i = 0; i < n; i++) {
+            int idx = (int) events[i].data.u32;
+            struct window_client *c = &t->clients[idx];
+            if (c->wake < 0) continue;
+            window_client_receive(c);
+            /* Answers can open the window now; a later wakeup still queued just finds nothing to do */
+            if (!window_client_send(c, now)) {
+                window_client_finish(c);
+                close(c->sockfd);
+                c->wake = -1;
+                running--;
+                continue;
+            }
+            int64_t wake = window_client_wake(c, now);
+            if (wake < c->wake) {
+                c->wake = wake;
+                heap_push(&heap, wake, idx);
             }
-            last_activity = time(NULL);
         }
     }
-    for (int i = 1; i <= N; i++) {
-        if (reqs[i].received)
-            printf("%d: %.4f %.4f\n", i, reqs[i].theta, reqs[i].delta);
-        else
-            printf("%d: Dropped\n", i);
+    free(heap.t);
+    close(epfd);
+    pthread_mutex_lock(&t->run->lock);
+    t->run->running--;
+    pthread_cond_signal(&t->run->done);
+    pthread_mutex_unlock(&t->run->lock);
+    return NULL;
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
-    fflush(stdout);
-    free(reqs);
 }
 
-int main(int argc, char *argv[]) {
-    struct client_arguments args = client_parseopt(argc, argv);
+static int client_socket(const struct client_arguments *args) {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd == -1) {
         perror("socket");
         exit(1);
     }
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (args->kernel_ts && setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0) {
+        perror("setsockopt(SO_TIMESTAMPING)");
+        exit(1);
+    }
+    return sockfd;
+}
+
+/*
+ * Emulate many clients: K windowed senders, each on its own socket and so
+ * its own source port, with its own sequence space and pacing, so the
+ * server has to track K (addr, port) entries. A few threads share them,
+ * each waiting on its sockets with epoll and on their timers with a heap.
+ * Every virtual client keeps only a summary; the full statistics are per
+ * thread and merged into sink->st.
+ *
+ * Memory grows with K times the window: each client rings 2 * window
+ * request records of 64 bytes and starts its send log at as many 12-byte
+ * entries, about 150 bytes per window slot or 10 KiB at the default 64.
+ */
+void orchestrate_many_clients(struct sockaddr_in *servaddr, const struct client_arguments *args,
+                              struct sample_sink *sink) {
+    int K = args->clients;
+    int T = args->client_threads < K ? args->client_threads : K;
+    raise_fd_limit();
+    struct window_client *clients = calloc(K, sizeof(*clients));
+    struct client_thread *threads = calloc(T, sizeof(*threads));
+    if (!clients || !threads) {
+        perror("calloc");
+        exit(1);
+    }
+    size_t slots = 16;
+    while (slots < (size_t) args->window * 2) slots *= 2;
+    struct run_state run = { .running = T };
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.done, &attr);
+    for (int t = 0; t < T; t++) {
+        struct client_thread *th = &threads[t];
+        th->clients = clients + (int64_t) K * t / T;
+        th->nclients = (int) ((int64_t) K * (t + 1) / T - (int64_t) K * t / T);
+        sample_stats_init(&th->st);
+        pthread_mutex_init(&th->lock, NULL);
+        th->run = &run;
+        for (int i = 0; i < th->nclients; i++) {
+            struct window_client *c = &th->clients[i];
+            int sockfd = client_socket(args);
+            struct sockaddr_in local = { .sin_family = AF_INET };
+            socklen_t len = sizeof(local);
+            if (bind(sockfd, (SA *) &local, sizeof(local)) != 0 || getsockname(sockfd, (SA *) &local, &len) != 0) {
+                perror("bind");
+                exit(1);
+            }
+            struct sample_sink own = { .stats = 1, .st = &th->st, .lock = &th->lock };
+            window_client_init(c, sockfd, servaddr, args, &own, slots, slots);
+            c->sink.client = &c->summary;
+            c->port = ntohs(local.sin_port);
+        }
+    }
+    for (int t = 0; t < T; t++) {
+        if (pthread_create(&threads[t].thread, NULL, client_thread_main, &threads[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    int64_t report = (int64_t) args->report_secs * 1000000000;
+    int64_t started = mono_ns(), next_report = started + report;
+    pthread_mutex_lock(&run.lock);
+    while (run.running > 0) {
+        if (!report) {
+            pthread_cond_wait(&run.done, &run.lock);
+            continue;
+        }
+        struct timespec until = { next_report / 1000000000, next_report % 1000000000 };
+        if (pthread_cond_timedwait(&run.done, &run.lock, &until) != ETIMEDOUT) continue;
+        pthread_mutex_unlock(&run.lock);
+        struct sample_stats so_far;
+        sample_stats_init(&so_far);
+        for (int t = 0; t < T; t++) {
+            pthread_mutex_lock(&threads[t].lock);
+            sample_stats_merge(&so_far, &threads[t].st);
+            pthread_mutex_unlock(&threads[t].lock);
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "[%.1fs] ", (mono_ns() - started) / 1e9);
+        sample_stats_report(&so_far, stdout, label);
+        fflush(stdout);
+        next_report += report;
+        pthread_mutex_lock(&run.lock);
+    }
+    pthread_mutex_unlock(&run.lock);
+
+    long long retransmits = 0;
+    for (int t = 0; t < T; t++) {
+        pthread_join(threads[t].thread, NULL);
+        sample_stats_merge(sink->st, &threads[t].st);
+    }
+    for (int i = 0; i < K; i++) {
+        const struct sample_summary *s = &clients[i].summary;
+        printf("client %d port %u: received %llu dropped %llu retransmitted %llu", i + 1, clients[i].port,
+               (unsigned long long) s->received, (unsigned long long) s->dropped,
+               (unsigned long long) s->retransmitted);
+        if (s->received) {
+            printf(" delta min %.6f mean %.6f max %.6f", s->delta.min, s->delta.mean, s->delta.max);
+        }
+        if (s->have_best) printf(" offset %.6f", s->best_theta);
+        printf("\n");
+        retransmits += clients[i].retransmits;
+    }
+    if (retransmits) fprintf(stderr, "%lld retransmissions\n", retransmits);
+    free(threads);
+    free(clients);
+}
+
+int main(int argc, char *argv[]) {
+    struct client_arguments args = client_parseopt(argc, argv);
     struct sockaddr_in servaddr = { 0 };
     servaddr.sin_family = AF_INET;
     servaddr.sin_port = htons(args.port);
     inet_pton(AF_INET, args.ip_address, &servaddr.sin_addr);
-    orchestrate_client_protocol(sockfd, &servaddr, args.n_requests, args.timeout_secs, args.condensed);
-    close(sockfd);
+    struct sample_stats st;
+    sample_stats_init(&st);
+    struct sample_sink sink = { .stats = args.stats, .st = &st };
+    if (args.sample_log) {
+        sink.log = fopen(args.sample_log, "wb");
+        if (!sink.log) {
+            perror(args.sample_log);
+            exit(1);
+        }
+    }
+    if (args.clients > 0) {
+        orchestrate_many_clients(&servaddr, &args, &sink);
+    } else {
+        int sockfd = client_socket(&args);
+        if (args.window > 0) {
+            orchestrate_windowed_protocol(sockfd, &servaddr, &args, &sink);
+        } else {
+            orchestrate_client_protocol(sockfd, &servaddr, args.n_requests, args.timeout_secs, args.condensed,
+                                        args.kernel_ts, &sink);
+        }
+        close(sockfd);
+    }
+    if (args.stats) sample_stats_report(&st, stdout, "");
+    fflush(stdout);
+    if (sink.log) fclose(sink.log);
     return 0;
 }
@@ -0,0 +1,205 @@
+#include "udp_proto.h"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PROTO_SIMD_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define PROTO_SIMD_ARM 1
+#endif
+#endif
+
+/*
+ * Byte shuffles from one layout to the other, 16 bytes at a time. Entry i
+ * is the source byte of destination byte i; 0x80 yields a zero, both for
+ * pshufb and for tbl. The standard format only swaps fields in place, so
+ * the same tables encode and decode it; the condensed one also moves the
+ * fields after its 16-bit version by two bytes.
+ */
+static const uint8_t swap_4_4_8[16] = { 3, 2, 1, 0, 7, 6, 5, 4, 15, 14, 13, 12, 11, 10, 9, 8 };
+static const uint8_t swap_8_8[16] = { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 };
+/* seq, version widened from 16 bits, T0 sec */
+static const uint8_t from_condensed[16] = { 3, 2, 1, 0, 5, 4, 0x80, 0x80, 13, 12, 11, 10, 9, 8, 7, 6 };
+/* seq, version cut to 16 bits, T0 sec; the last two bytes are garbage the next field overwrites */
+static const uint8_t to_condensed[16] = { 3, 2, 1, 0, 5, 4, 15, 14, 13, 12, 11, 10, 9, 8, 0x80, 0x80 };
+
+static inline void swap64(uint8_t *dst, const uint8_t *src) {
+    uint64_t v;
+    memcpy(&v, src, 8);
+    v = __builtin_bswap64(v);
+    memcpy(dst, &v, 8);
+}
+
+static void encode_requests_scalar(const struct time_request *r, int n, int condensed, uint8_t *bufs, size_t stride) {
+    for (int i = 0; i < n; i++) encode_request(&r[i], condensed, bufs + i * stride);
+}
+
+static void decode_requests_scalar(const uint8_t *bufs, size_t stride, int n, int condensed, struct time_request *r) {
+    for (int i = 0; i < n; i++) decode_request(bufs + i * stride, condensed, &r[i]);
+}
+
+static void encode_responses_scalar(const struct time_response *r, int n, int condensed, uint8_t *bufs,
+                                    size_t stride) {
+    for (int i = 0; i < n; i++) encode_response(&r[i], condensed, bufs + i * stride);
+}
+
+static void decode_responses_scalar(const uint8_t *bufs, size_t stride, int n, int condensed,
+                                    struct time_response *r) {
+    for (int i = 0; i < n; i++) decode_response(bufs + i * stride, condensed, &r[i]);
+}
+
+/*
+ * The kernels, written once over SHUFFLE(dst, src, mask): 16 bytes from
+ * src, rearranged by mask, stored at dst. Every load and store stays
+ * inside its packet: the condensed tails that do not fill 16 bytes go
+ * through swap64 at their own offsets instead.
+ */
+#define DEFINE_KERNELS(suffix, attr, MASK, SHUFFLE)                                                                  \
+    attr static void encode_requests_##suffix(const struct time_request *r, int n, int condensed, uint8_t *bufs,     \
+                                              size_t stride) {                                                     \
+        const uint8_t *p = (const uint8_t *) r;                                                                    \
+        if (condensed) {                                                                                           \
+            for (int i = 0; i < n; i++, p += REQUEST_LEN, bufs += stride) {                                        \
+                SHUFFLE(bufs, p, MASK(to_condensed));                                                              \
+                swap64(bufs + 14, p + 16);                                                                         \
+            }                                                                                                      \
+        } else {                                                                                                   \
+            for (int i = 0; i < n; i++, p += REQUEST_LEN, bufs += stride) {                                        \
+                SHUFFLE(bufs, p, MASK(swap_4_4_8));                                                                \
+                swap64(bufs + 16, p + 16);                                                                         \
+            }                                                                                                      \
+        }                                                                                                          \
+    }                                                                                                              \
+    attr static void decode_requests_##suffix(const uint8_t *bufs, size_t stride, int n, int condensed,            \
+                                              struct time_request *r) {                                            \
+        uint8_t *p = (uint8_t *) r;                                                                                \
+        if (condensed) {                                                                                           \
+            for (int i = 0; i < n; i++, p += REQUEST_LEN, bufs += stride) {                                        \
+                SHUFFLE(p, bufs, MASK(from_condensed));                                                            \
+                swap64(p + 16, bufs + 14);                                                                         \
+            }                                                                                                      \
+        } else {                                                                                                   \
+            for (int i = 0; i < n; i++, p += REQUEST_LEN, bufs += stride) {                                        \
+                SHUFFLE(p, bufs, MASK(swap_4_4_8));                                                                \
+                swap64(p + 16, bufs + 16);                                                                         \
+            }                                                                                                      \
+        }                                                                                                          \
+    }                                                                                                              \
+    attr static void encode_responses_##suffix(const struct time_response *r, int n, int condensed, uint8_t *bufs,   \
+                                               size_t stride) {                                                    \
+        const uint8_t *p = (const uint8_t *) r;                                                                    \
+        if (condensed) {                                                                                           \
+            for (int i = 0; i < n; i++, p += RESPONSE_LEN, bufs += stride) {                                       \
+                SHUFFLE(bufs, p, MASK(to_condensed));                                                              \
+                swap64(bufs + 14, p + 16);                                                                         \
+                swap64(bufs + 22, p + 24);                                                                         \
+                swap64(bufs + 30, p + 32);                                                                         \
+            }                                                                                                      \
+        } else {                                                                                                   \
+            for (int i = 0; i < n; i++, p += RESPONSE_LEN, bufs += stride) {                                       \
+                SHUFFLE(bufs, p, MASK(swap_4_4_8));                                                                \
+                SHUFFLE(bufs + 16, p + 16, MASK(swap_8_8));                                                        \
+                swap64(bufs + 32, p + 32);                                                                         \
+            }                                                                                                      \
+        }                                                                                                          \
+    }                                                                                                              \
+    attr static void decode_responses_##suffix(const uint8_t *bufs, size_t stride, int n, int condensed,           \
+                                               struct time_response *r) {                                          \
+        uint8_t *p = (uint8_t *) r;                                                                                \
+        if (condensed) {                                                                                           \
+            for (int i = 0; i < n; i++, p += RESPONSE_LEN, bufs += stride) {                                       \
+                SHUFFLE(p, bufs, MASK(from_condensed));                                                            \
+                swap64(p + 16, bufs + 14);                                                                         \
+                swap64(p + 24, bufs + 22);                                                                         \
+                swap64(p + 32, bufs + 30);                                                                         \
+            }                                                                                                      \
+        } else {                                                                                                   \
+            for (int i = 0; i < n; i++, p += RESPONSE_LEN, bufs += stride) {                                       \
+                SHUFFLE(p, bufs, MASK(swap_4_4_8));                                                                \
+                SHUFFLE(p + 16, bufs + 16, MASK(swap_8_8));                                                        \
+                swap64(p + 32, bufs + 32);                                                                         \
+            }                                                                                                      \
+        }                                                                                                          \
+    }
+
+#ifdef PROTO_SIMD_X86
+#define SSSE3_MASK(t) _mm_loadu_si128((const __m128i *) (t))
+#define SSSE3_SHUFFLE(dst, src, mask) \
+    _mm_storeu_si128((__m128i *) (dst), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src)), (mask)))
+DEFINE_KERNELS(ssse3, __attribute__((target("ssse3"))), SSSE3_MASK, SSSE3_SHUFFLE)
+#endif
+
+#ifdef PROTO_SIMD_ARM
+#define NEON_MASK(t) vld1q_u8(t)
+#define NEON_SHUFFLE(dst, src, mask) vst1q_u8((dst), vqtbl1q_u8(vld1q_u8(src), (mask)))
+DEFINE_KERNELS(neon, , NEON_MASK, NEON_SHUFFLE)
+#endif
+
+struct proto_kernel {
+    const char *name;
+    void (*encode_requests)(const struct time_request *, int, int, uint8_t *, size_t);
+    void (*decode_requests)(const uint8_t *, size_t, int, int, struct time_request *);
+    void (*encode_responses)(const struct time_response *, int, int, uint8_t *, size_t);
+    void (*decode_responses)(const uint8_t *, size_t, int, int, struct time_response *);
+};
+
+static const struct proto_kernel scalar_kernel = {
+    "scalar", encode_requests_scalar, decode_requests_scalar, encode_responses_scalar, decode_responses_scalar,
+};
+
+#ifdef PROTO_SIMD_X86
+static const struct proto_kernel simd_kernel = {
+    "ssse3", encode_requests_ssse3, decode_requests_ssse3, encode_responses_ssse3, decode_responses_ssse3,
+};
+#elif defined(PROTO_SIMD_ARM)
+static const struct proto_kernel simd_kernel = {
+    "neon", encode_requests_neon, decode_requests_neon, encode_responses_neon, decode_responses_neon,
+};
+#endif
+
+static const struct proto_kernel *kernel;
+
+static const struct proto_kernel *best_kernel(void) {
+#ifdef PROTO_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) return &simd_kernel;
+#elif defined(PROTO_SIMD_ARM)
+    return &simd_kernel;
+#endif
+    return &scalar_kernel;
+}
+
+/* Picked on first use; a benign race, since every thread would pick the same */
+static inline const struct proto_kernel *current(void) {
+    const struct proto_kernel *k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (!k) {
+        k = best_kernel();
+        __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+    }
+    return k;
+}
+
+void proto_use_simd(int on) {
+    __atomic_store_n(&kernel, on ? best_kernel() : &scalar_kernel, __ATOMIC_RELAXED);
+}
+
+const char *proto_kernel_name(void) {
+    return current()->name;
+}
+
+void encode_requests(const struct time_request *r, int n, int condensed, uint8_t *bufs, size_t stride) {
+    current()->encode_requests(r, n, condensed, bufs, stride);
+}
+
+void decode_requests(const uint8_t *bufs, size_t stride, int n, int condensed, struct time_request *r) {
+    current()->decode_requests(bufs, stride, n, condensed, r);
+}
+
+void encode_responses(const struct time_response *r, int n, int condensed, uint8_t *bufs, size_t stride) {
+    current()->encode_responses(r, n, condensed, bufs, stride);
+}
+
+void decode_responses(const uint8_t *bufs, size_t stride, int n, int condensed, struct time_response *r) {
+    current()->decode_responses(bufs, stride, n, condensed, r);
+}
@@ -0,0 +1,175 @@
+#ifndef UDP_PROTO_H
+#define UDP_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <assert.h>
+
+/*
+ * Wire formats of the UDP time protocol, shared by udp_client and
+ * udp_server. Every field is big-endian.
+ *
+ *   request     seq u32, version u32, T0 sec u64, T0 nsec u64       24 bytes
+ *   response    the request, then T1 sec u64, T1 nsec u64           40 bytes
+ *   condensed   the same with a u16 version, unpadded               22 / 38 bytes
+ *
+ * Decoded packets are host-order structs laid out like the standard
+ * format, so the batch codecs turn one into the other with a byte shuffle
+ * per 16 bytes (SSSE3 pshufb or NEON tbl) instead of a swap per field.
+ * Per-packet codecs are here as inline functions; the batch ones, which
+ * pick their kernel at run time, are in udp_proto.c.
+ */
+
+#define PROTO_VERSION 7
+
+struct __attribute__((__packed__)) condensed_request {
+    uint32_t seq_be;
+    uint16_t ver_be;
+    uint64_t c_sec_be;
+    uint64_t c_nsec_be;
+};
+
+struct __attribute__((__packed__)) condensed_response {
+    uint32_t seq_be;
+    uint16_t ver_be;
+    uint64_t c_sec_be;
+    uint64_t c_nsec_be;
+    uint64_t s_sec_be;
+    uint64_t s_nsec_be;
+};
+
+struct time_request {
+    uint32_t seq;
+    uint32_t version;
+    uint64_t c_sec, c_nsec;
+};
+
+struct time_response {
+    uint32_t seq;
+    uint32_t version;
+    uint64_t c_sec, c_nsec;
+    uint64_t s_sec, s_nsec;
+};
+
+#define REQUEST_LEN 24
+#define RESPONSE_LEN 40
+
+static_assert(sizeof(struct condensed_request) == 22, "condensed request is 22 bytes on the wire");
+static_assert(sizeof(struct condensed_response) == 38, "condensed response is 38 bytes on the wire");
+static_assert(offsetof(struct condensed_response, s_sec_be) == sizeof(struct condensed_request),
+              "a condensed response starts with the request");
+static_assert(sizeof(struct time_request) == REQUEST_LEN && offsetof(struct time_request, c_sec) == 8,
+              "decoded requests mirror the standard layout");
+static_assert(sizeof(struct time_response) == RESPONSE_LEN && offsetof(struct time_response, s_sec) == 24,
+              "decoded responses mirror the standard layout");
+
+static inline size_t request_len(int condensed) {
+    return condensed ? sizeof(struct condensed_request) : REQUEST_LEN;
+}
+
+static inline size_t response_len(int condensed) {
+    return condensed ? sizeof(struct condensed_response) : RESPONSE_LEN;
+}
+
+static inline void put_u32(uint8_t *b, uint32_t v) {
+    uint32_t n = htobe32(v);
+    memcpy(b, &n, 4);
+}
+
+static inline uint32_t get_u32(const uint8_t *b) {
+    uint32_t n;
+    memcpy(&n, b, 4);
+    return be32toh(n);
+}
+
+static inline void put_u64(uint8_t *b, uint64_t v) {
+    uint64_t n = htobe64(v);
+    memcpy(b, &n, 8);
+}
+
+static inline uint64_t get_u64(const uint8_t *b) {
+    uint64_t n;
+    memcpy(&n, b, 8);
+    return be64toh(n);
+}
+
+/*
+ * Per-packet codecs. Encoders return the bytes written; decoders read a
+ * whole packet, so the buffer must hold request_len or response_len bytes
+ * whatever arrived. In the condensed format the version is 16 bits. The
+ * head is what both directions share: seq, version and T0; its codecs
+ * return the offset of whatever follows.
+ */
+static inline size_t encode_head(uint8_t *b, int condensed, uint32_t seq, uint32_t version, uint64_t sec,
+                                 uint64_t nsec) {
+    size_t at = 8;
+    put_u32(b, seq);
+    if (condensed) {
+        uint16_t ver = htobe16((uint16_t) version);
+        memcpy(b + 4, &ver, 2);
+        at = 6;
+    } else {
+        put_u32(b + 4, version);
+    }
+    put_u64(b + at, sec);
+    put_u64(b + at + 8, nsec);
+    return at + 16;
+}
+
+static inline size_t decode_head(const uint8_t *b, int condensed, uint32_t *seq, uint32_t *version, uint64_t *sec,
+                                 uint64_t *nsec) {
+    size_t at = 8;
+    *seq = get_u32(b);
+    if (condensed) {
+        uint16_t ver;
+        memcpy(&ver, b + 4, 2);
+        *version = be16toh(ver);
+        at = 6;
+    } else {
+        *version = get_u32(b + 4);
+    }
+    *sec = get_u64(b + at);
+    *nsec = get_u64(b + at + 8);
+    return at + 16;
+}
+
+static inline size_t encode_request(const struct time_request *r, int condensed, uint8_t *b) {
+    return encode_head(b, condensed, r->seq, r->version, r->c_sec, r->c_nsec);
+}
+
+static inline void decode_request(const uint8_t *b, int condensed, struct time_request *r) {
+    decode_head(b, condensed, &r->seq, &r->version, &r->c_sec, &r->c_nsec);
+}
+
+static inline size_t encode_response(const struct time_response *r, int condensed, uint8_t *b) {
+    size_t at = encode_head(b, condensed, r->seq, r->version, r->c_sec, r->c_nsec);
+    put_u64(b + at, r->s_sec);
+    put_u64(b + at + 8, r->s_nsec);
+    return at + 16;
+}
+
+static inline void decode_response(const uint8_t *b, int condensed, struct time_response *r) {
+    size_t at = decode_head(b, condensed, &r->seq, &r->version, &r->c_sec, &r->c_nsec);
+    r->s_sec = get_u64(b + at);
+    r->s_nsec = get_u64(b + at + 8);
+}
+
+/*
+ * Batch codecs over n packets whose wire buffers sit stride bytes apart,
+ * as in the arrays behind recvmmsg/sendmmsg. Same results as the
+ * per-packet ones.
+ */
+void encode_requests(const struct time_request *r, int n, int condensed, uint8_t *bufs, size_t stride);
+void decode_requests(const uint8_t *bufs, size_t stride, int n, int condensed, struct time_request *r);
+void encode_responses(const struct time_response *r, int n, int condensed, uint8_t *bufs, size_t stride);
+void decode_responses(const uint8_t *bufs, size_t stride, int n, int condensed, struct time_response *r);
+
+/* Name of the batch kernel in use: "ssse3", "neon" or "scalar". */
+const char *proto_kernel_name(void);
+
+/* Force the scalar batch kernel (0) or go back to the best one (1), for benchmarks. */
+void proto_use_simd(int on);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "udp_proto.h"
+
+/*
+ * Nanoseconds per packet of the UDP time protocol codecs, for both wire
+ * formats: the per-packet inline functions in a loop, as the client and
+ * server used to call them, against the batch functions with the scalar
+ * and the SIMD kernel. Packets sit STRIDE bytes apart as in udp_server's
+ * recvmmsg buffers, BATCH at a time. Every batch kernel is checked against
+ * the per-packet codec before it is timed.
+ *
+ * Usage: udp_proto_bench [iterations]
+ */
+
+#define BATCH 32
+#define STRIDE 64
+
+static struct time_request reqs[BATCH], reqs_out[BATCH];
+static struct time_response resps[BATCH], resps_out[BATCH];
+static uint8_t wire[BATCH][STRIDE], wire_out[BATCH][STRIDE];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rnd(void) {
+    static uint64_t x = 0x9e3779b97f4a7c15ULL;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/* Random packets, both decoded and on the wire; the wire holds responses only for the response decoder */
+static void fill(int condensed, int wire_responses) {
+    for (int i = 0; i < BATCH; i++) {
+        uint32_t version = condensed ? (uint16_t) rnd() : (uint32_t) rnd();
+        reqs[i] = (struct time_request) { (uint32_t) rnd(), version, rnd(), rnd() };
+        resps[i] = (struct time_response) { (uint32_t) rnd(), version, rnd(), rnd(), rnd(), rnd() };
+        if (wire_responses) {
+            encode_response(&resps[i], condensed, wire[i]);
+        } else {
+            encode_request(&reqs[i], condensed, wire[i]);
+        }
+    }
+}
+
+enum op { ENCODE_REQUESTS, DECODE_REQUESTS, ENCODE_RESPONSES, DECODE_RESPONSES };
+static const char *op_names[] = { "encode requests", "decode requests", "encode responses", "decode responses" };
+
+/* One batch through the per-packet codec (batch = 0) or the batch one */
+static void run(enum op op, int condensed, int batch) {
+    switch (op) {
+    case ENCODE_REQUESTS:
+        if (batch) {
+            encode_requests(reqs, BATCH, condensed, wire_out[0], STRIDE);
+        } else {
+            for (int i = 0; i < BATCH; i++) encode_request(&reqs[i], condensed, wire_out[i]);
+        }
+        break;
+    case DECODE_REQUESTS:
+        if (batch) {
+            decode_requests(wire[0], STRIDE, BATCH, condensed, reqs_out);
+        } else {
+            for (int i = 0; i < BATCH; i++) decode_request(wire[i], condensed, &reqs_out[i]);
+        }
+        break;
+    case ENCODE_RESPONSES:
+        if (batch) {
+            encode_responses(resps, BATCH, condensed, wire_out[0], STRIDE);
+        } else {
+            for (int i = 0; i < BATCH; i++) encode_response(&resps[i], condensed, wire_out[i]);
+        }
+        break;
+    case DECODE_RESPONSES:
+        if (batch) {
+            decode_responses(wire[0], STRIDE, BATCH, condensed, resps_out);
+        } else {
+            for (int i = 0; i < BATCH; i++) decode_response(wire[i], condensed, &resps_out[i]);
+        }
+        break;
+    }
+}
+
+/* The batch kernel in use must give exactly what the per-packet codec gives */
+static int check(enum op op, int condensed) {
+    static uint8_t expect_wire[BATCH][STRIDE];
+    static struct time_request expect_reqs[BATCH];
+    static struct time_response expect_resps[BATCH];
+    memset(wire_out, 0xa5, sizeof(wire_out));
+    run(op, condensed, 0);
+    memcpy(expect_wire, wire_out, sizeof(wire_out));
+    memcpy(expect_reqs, reqs_out, sizeof(reqs_out));
+    memcpy(expect_resps, resps_out, sizeof(resps_out));
+    memset(wire_out, 0xa5, sizeof(wire_out));
+    run(op, condensed, 1);
+    if (op == ENCODE_REQUESTS || op == ENCODE_RESPONSES) {
+        /* Nothing past the packet may be touched either */
+        return memcmp(wire_out, expect_wire, sizeof(wire_out)) == 0 ? 0 : -1;
+    }
+    if (op == DECODE_REQUESTS) return memcmp(reqs_out, expect_reqs, sizeof(reqs_out)) == 0 ? 0 : -1;
+    return memcmp(resps_out, expect_resps, sizeof(resps_out)) == 0 ? 0 : -1;
+}
+
+static double time_op(enum op op, int condensed, int batch, long iters) {
+    for (long i = 0; i < iters / 10; i++) run(op, condensed, batch);
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++) {
+        wire[0][0] = (uint8_t) i;
+        reqs[0].seq = (uint32_t) i;
+        resps[0].seq = (uint32_t) i;
+        run(op, condensed, batch);
+    }
+    return (now_ns() - t0) / ((double) iters * BATCH);
+}
+
+int main(int argc, char *argv[]) {
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+    if (iters < 10) iters = 10;
+    proto_use_simd(1);
+    const char *simd = proto_kernel_name();
+    printf("ns per packet, batches of %d\n\n", BATCH);
+    printf("%-28s %10s %10s %10s\n", "", "per-packet", "scalar", simd);
+    int failed = 0;
+    for (int condensed = 0; condensed <= 1; condensed++) {
+        for (enum op op = ENCODE_REQUESTS; op <= DECODE_RESPONSES; op++) {
+            char label[64];
+            snprintf(label, sizeof(label), "%s %s", condensed ? "condensed" : "standard", op_names[op]);
+            fill(condensed, op == DECODE_RESPONSES);
+            proto_use_simd(0);
+            double per_packet = time_op(op, condensed, 0, iters);
+            double scalar = time_op(op, condensed, 1, iters);
+            proto_use_simd(1);
+            fill(condensed, op == DECODE_RESPONSES);
+            if (check(op, condensed) != 0) {
+                printf("%-28s %s: WRONG RESULT\n", label, simd);
+                failed = 1;
+                continue;
+            }
+            printf("%-28s %10.2f %10.2f %10.2f\n", label, per_packet, scalar, time_op(op, condensed, 1, iters));
+        }
+    }
+    return failed;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,30 +9,146 @@
 #include <errno.h>
 #include <endian.h>
 #include <argp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include "client_table.h"
+#include "event_log.h"
+#include "impair.h"
+#include "metrics.h"
+#include "udp_proto.h"
 
-#define VERSION 7
-#define MAX_CLIENTS 256
 #define TWO_MINUTES 120
+#define MAX_BATCH 1024
+#define MAX_OUT (2 * MAX_BATCH)    /* every response of a batch, each possibly duplicated */
+#define MAX_THREADS 256
 #define SA struct sockaddr
 
 struct server_arguments {
     int port;
-    int drop_rate;
+    struct impair_config impair;
+    uint64_t seed;
+    int have_seed;
     int condensed;
+    int batch;
+    int threads;
+    int pin;
+    int steer_cpu;
+    int kernel_ts;
+    int stats_port;
+    int stats_interval;
+    char *event_log;
 };
 
+/* "a,b,..." into at most max numbers. Returns how many, or -1 unless every one is a number in [lo, hi]. */
+static int parse_numbers(const char *arg, double *v, int max, double lo, double hi) {
+    for (int n = 0; n < max;) {
+        char *end;
+        double x = strtod(arg, &end);
+        if (end == arg || !(x >= lo && x <= hi)) return -1;
+        v[n++] = x;
+        if (*end == '\0') return n;
+        if (*end != ',') return -1;
+        arg = end + 1;
+    }
+    return -1;
+}
+
 static error_t server_parser(int key, char *arg, struct argp_state *state) {
     struct server_arguments *a = state->input;
     switch (key) {
         case 'p':
             a->port = atoi(arg);
             break;
-        case 'd':
-            a->drop_rate = atoi(arg);
+        case 'd': {
+            double v = 0;
+            if (parse_numbers(arg, &v, 1, 0, 100) != 1) argp_error(state, "Invalid drop, must be a percentage between 0 and 100");
+            a->impair.drop = v / 100;
             break;
+        }
         case 'c':
             a->condensed = 1;
             break;
+        case 302:
+            a->batch = atoi(arg);
+            if (a->batch < 1 || a->batch > MAX_BATCH) {
+                argp_error(state, "Invalid batch, must be between 1 and %d", MAX_BATCH);
+            }
+            break;
+        case 't':
+            a->threads = atoi(arg);
+            if (a->threads < 1 || a->threads > MAX_THREADS) {
+                argp_error(state, "Invalid threads, must be between 1 and %d", MAX_THREADS);
+            }
+            break;
+        case 303:
+            a->pin = 1;
+            break;
+        case 304:
+            if (strcmp(arg, "cpu") == 0) {
+                a->steer_cpu = 1;
+            } else if (strcmp(arg, "hash") != 0) {
+                argp_error(state, "Invalid steering, must be hash or cpu");
+            }
+            break;
+        case 305:
+            a->kernel_ts = 1;
+            break;
+        case 306:
+            a->event_log = arg;
+            break;
+        case 307: {
+            char *end;
+            errno = 0;
+            a->seed = strtoull(arg, &end, 0);
+            if (errno || end == arg || *end || *arg == '-') argp_error(state, "Invalid seed, must be an unsigned 64-bit integer");
+            a->have_seed = 1;
+            break;
+        }
+        case 308: {
+            double v[3] = { 0, 0, 100 };
+            if (parse_numbers(arg, v, 3, 0, 100) < 2) argp_error(state, "Invalid burst loss, must be ENTER,LEAVE[,LOSS] in percent");
+            a->impair.burst_enter = v[0] / 100;
+            a->impair.burst_leave = v[1] / 100;
+            a->impair.burst_loss = v[2] / 100;
+            break;
+        }
+        case 309: {
+            double v[2] = { 0, 1 };
+            if (parse_numbers(arg, v, 2, 0, 100) < 1) argp_error(state, "Invalid reorder, must be P[,MS] with P in percent and MS at most 100");
+            a->impair.reorder = v[0] / 100;
+            a->impair.reorder_ns = (int64_t) (v[1] * 1e6);
+            break;
+        }
+        case 310: {
+            double v = 0;
+            if (parse_numbers(arg, &v, 1, 0, 100) != 1) argp_error(state, "Invalid duplicate, must be a percentage between 0 and 100");
+            a->impair.duplicate = v / 100;
+            break;
+        }
+        case 311: {
+            double v[2] = { 0, 0 };
+            if (parse_numbers(arg, v, 2, 0, 10000) < 1) argp_error(state, "Invalid delay, must be MS[,JITTER] with both at most 10000");
+            a->impair.delay_ns = (int64_t) (v[0] * 1e6);
+            a->impair.jitter_ns = (int64_t) (v[1] * 1e6);
+            break;
+        }
+        case 300:
+            a->stats_port = atoi(arg);
+            if (a->stats_port <= 0 || a->stats_port > 65535) {
+                argp_error(state, "Invalid stats port");
+            }
+            break;
+        case 301:
+            a->stats_interval = atoi(arg);
+            if (a->stats_interval < 0) {
+                argp_error(state, "Invalid stats interval, must not be negative");
+            }
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -41,12 +158,25 @@ static error_t server_parser(int key, char *arg, struct argp_state *state) {
 static struct server_arguments server_parseopt(int argc, char *argv[]) {
     static struct argp_option o[] = {
         {"port", 'p', "port", 0, "Port (>1024)", 0},
-        {"drop", 'd', "drop", 0, "Drop % [0-100]", 0},
+        {"drop", 'd', "drop", 0, "Drop % [0-100], fractions allowed; in the good state with --burst-loss", 0},
         {"condensed", 'c', 0, 0, "Use condensed format", 0},
+        {"batch", 302, "K", 0, "Receive and answer up to K datagrams per system call (default 32)", 0},
+        {"threads", 't', "N", 0, "Number of receive threads, each with its own SO_REUSEPORT socket", 0},
+        {"pin", 303, 0, 0, "Pin each thread to its own CPU, physical cores first", 0},
+        {"steer", 304, "mode", 0, "How the kernel picks a thread: hash (of the flow, default) or cpu (the thread pinned to the CPU that received it)", 0},
+        {"kernel-ts", 305, 0, 0, "Stamp responses with the kernel's receive time of the request (SO_TIMESTAMPING)", 0},
+        {"event-log", 306, "FILE", 0, "Write out-of-order reports to FILE as binary records instead of text to stdout", 0},
+        {"seed", 307, "S", 0, "Seed the impairment generators, for runs that repeat exactly (default: from the clock)", 0},
+        {"burst-loss", 308, "ENTER,LEAVE[,LOSS]", 0, "Gilbert-Elliott loss: % chance per request to enter and to leave the bad state, and its loss % (default 100)", 0},
+        {"reorder", 309, "P[,MS]", 0, "Hold P% of responses back by MS milliseconds (default 1) so later ones overtake them", 0},
+        {"duplicate", 310, "P", 0, "Send P% of responses twice", 0},
+        {"delay", 311, "MS[,JITTER]", 0, "Delay every response by MS plus up to JITTER milliseconds", 0},
+        {"stats-port", 300, "port", 0, "Serve metrics in the Prometheus text format over HTTP on this port", 0},
+        {"stats-interval", 301, "S", 0, "Print the metrics to stderr every S seconds (0 = never)", 0},
         {0}
     };
     struct argp a = { o, server_parser, 0, 0 };
-    struct server_arguments s = { 0 };
+    struct server_arguments s = { .batch = 32, .threads = 1 };
     argp_parse(&a, argc, argv, 0, NULL, &s);
     return s;
 }
@@ -57,161 +187,413 @@ static inline struct timespec now_ts(void) {
     return ts;
 }
 
-static inline void put_u32(uint8_t *b, uint32_t v) {
-    uint32_t n = htonl(v);
-    memcpy(b, &n, 4);
-}
-
-static inline uint32_t get_u32(const uint8_t *b) {
-    uint32_t n;
-    memcpy(&n, b, 4);
-    return ntohl(n);
+static inline int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static inline void put_u64(uint8_t *b, uint64_t v) {
-    uint64_t n = htobe64(v);
-    memcpy(b, &n, 8);
-}
+/* Written only by the receive loop; the stats thread sums it when asked (see metrics.h). */
+struct server_metrics {
+    _Alignas(64) uint64_t datagrams;
+    uint64_t bytes_in, bytes_out;
+    uint64_t responses;
+    uint64_t dropped;           /* by the simulated drop rate */
+    uint64_t duplicated, reordered;
+    uint64_t held;
+    uint64_t malformed;
+    uint64_t out_of_order;
+    uint64_t out_of_order_dropped;
+    uint64_t table_full;
+    uint64_t expired;
+    uint64_t clients;
+    struct metrics_hist batch_size;
+    struct metrics_hist processing_ns;
+};
 
-static inline uint64_t get_u64(const uint8_t *b) {
-    uint64_t n;
-    memcpy(&n, b, 8);
-    return be64toh(n);
-}
+#define COUNTER(field, name, help) { name, help, METRIC_COUNTER, offsetof(struct server_metrics, field), 0, 0, 0 }
 
-struct __attribute__((__packed__)) condensed_request {
-    uint32_t seq_be;
-    uint16_t ver_be;
-    uint64_t c_sec_be;
-    uint64_t c_nsec_be;
+static const struct metric_desc server_metric_descs[] = {
+    COUNTER(datagrams, "datagrams_total", "Datagrams received."),
+    COUNTER(bytes_in, "received_bytes_total", "Bytes received."),
+    COUNTER(bytes_out, "sent_bytes_total", "Bytes sent."),
+    COUNTER(responses, "responses_total", "Responses sent."),
+    COUNTER(dropped, "dropped_total", "Requests dropped on purpose by --drop or --burst-loss."),
+    COUNTER(duplicated, "duplicated_total", "Responses sent twice by --duplicate."),
+    COUNTER(reordered, "reordered_total", "Responses held back by --reorder."),
+    { "held", "Responses waiting out a simulated delay.", METRIC_GAUGE, offsetof(struct server_metrics, held), 0, 0, 0 },
+    COUNTER(malformed, "malformed_total", "Datagrams too short or of another version."),
+    COUNTER(out_of_order, "out_of_order_total", "Requests whose sequence number was below the highest one seen from that client."),
+    COUNTER(out_of_order_dropped, "out_of_order_reports_dropped_total", "Out-of-order reports lost because the logger fell behind."),
+    COUNTER(table_full, "client_table_full_total", "Requests from clients the table had no memory left for."),
+    COUNTER(expired, "clients_expired_total", "Clients forgotten after two minutes without progress."),
+    { "clients", "Clients in the table.", METRIC_GAUGE, offsetof(struct server_metrics, clients), 0, 0, 0 },
+    { "batch_size", "Datagrams per receive call.", METRIC_HISTOGRAM, offsetof(struct server_metrics, batch_size), 1, 0, 10 },
+    { "processing_seconds", "Time from receiving a request to sending its response.", METRIC_HISTOGRAM,
+      offsetof(struct server_metrics, processing_ns), 1e-9, 8, 26 },
 };
 
-struct __attribute__((__packed__)) condensed_response {
-    uint32_t seq_be;
-    uint16_t ver_be;
-    uint64_t c_sec_be;
-    uint64_t c_nsec_be;
-    uint64_t s_sec_be;
-    uint64_t s_nsec_be;
+/*
+ * One receive thread. The kernel keeps a flow on one SO_REUSEPORT socket,
+ * so every client's state lives in exactly one worker and needs no lock.
+ */
+struct worker {
+    int id;
+    int fd;
+    int cpu;
+    pthread_t thread;
+    struct impair impair;
+    const struct server_arguments *args;
+    struct client_table clients;
+    struct server_metrics *metrics;
+    struct event_ring *events;
 };
 
-struct client_state {
-    struct in_addr addr;
-    uint16_t port;
-    uint32_t max_seq;
-    time_t last_update;
-    int active;
+/* Receive and response buffers for one batch */
+struct batch_io {
+    uint8_t bufs[MAX_BATCH][64];
+    struct time_request reqs[MAX_BATCH];
+    struct time_response answers[MAX_BATCH];
+    int answered[MAX_BATCH];                    /* index in the batch of each answer */
+    uint8_t resps[MAX_BATCH][RESPONSE_LEN];
+    struct sockaddr_in addrs[MAX_BATCH];
+    struct held_datagram released[MAX_BATCH];   /* out of the timer queue */
+    struct iovec in_iov[MAX_BATCH], out_iov[MAX_OUT];
+    struct mmsghdr in[MAX_BATCH], out[MAX_OUT];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } control[MAX_BATCH];
 };
 
-static struct client_state clients[MAX_CLIENTS];
+/* The software receive time in an SCM_TIMESTAMPING control message, if the kernel attached one. */
+static int rx_timestamp(struct msghdr *msg, struct timespec *ts) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_TIMESTAMPING) continue;
+        struct scm_timestamping tss;
+        memcpy(&tss, CMSG_DATA(cm), sizeof(tss));
+        if (tss.ts[0].tv_sec == 0 && tss.ts[0].tv_nsec == 0) return 0;
+        *ts = tss.ts[0];
+        return 1;
+    }
+    return 0;
+}
 
-static struct client_state *get_client_slot(struct sockaddr_in *cli) {
+/*
+ * Turn one decoded request of n bytes into its response, stamped with rx
+ * if the kernel gave us one and with the current time otherwise. Returns
+ * 0 if the request was dropped or malformed and gets no answer.
+ */
+static int handle_request(struct worker *w, const struct time_request *req, ssize_t n, struct sockaddr_in *cli,
+                          const struct timespec *rx, struct time_response *resp) {
+    struct server_metrics *m = w->metrics;
+    metric_add(&m->datagrams, 1);
+    metric_add(&m->bytes_in, n);
+    if (impair_drop(&w->impair)) {
+        metric_add(&m->dropped, 1);
+        return 0;
+    }
+    if (n < (ssize_t) request_len(w->args->condensed) || req->version != PROTO_VERSION) {
+        metric_add(&m->malformed, 1);
+        return 0;
+    }
+    uint32_t seq = req->seq;
     time_t now = time(NULL);
-    uint16_t port = ntohs(cli->sin_port);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active && clients[i].addr.s_addr == cli->sin_addr.s_addr && clients[i].port == port) {
-            if (now - clients[i].last_update > TWO_MINUTES) {
-                clients[i].max_seq = 0;
-            }
-            return &clients[i];
+    struct client_entry *slot = client_table_get(&w->clients, cli->sin_addr.s_addr, cli->sin_port, now);
+    if (slot) {
+        if (now - slot->last_update > TWO_MINUTES) slot->max_seq = 0;
+        if (slot->max_seq && seq < slot->max_seq) {
+            metric_add(&m->out_of_order, 1);
+            struct ooo_event e = { cli->sin_addr.s_addr, cli->sin_port, (uint16_t) w->id, seq, slot->max_seq };
+            if (event_ring_push(w->events, &e) < 0) metric_add(&m->out_of_order_dropped, 1);
+        }
+        if (seq > slot->max_seq) {
+            slot->max_seq = seq;
+            slot->last_update = now;
         }
+    } else {
+        metric_add(&m->table_full, 1);
     }
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (!clients[i].active) {
-            clients[i].active = 1;
-            clients[i].addr = cli->sin_addr;
-            clients[i].port = port;
-            clients[i].max_seq = 0;
-            clients[i].last_update = now;
-            return &clients[i];
+    struct timespec t = rx ? *rx : now_ts();
+    *resp = (struct time_response) {
+        seq, PROTO_VERSION, req->c_sec, req->c_nsec, (uint64_t) t.tv_sec, (uint64_t) t.tv_nsec,
+    };
+    return 1;
+}
+
+static int add_out(struct batch_io *io, int nout, struct sockaddr_in *to, socklen_t tolen, uint8_t *data, size_t len) {
+    io->out_iov[nout] = (struct iovec) { data, len };
+    io->out[nout].msg_hdr = (struct msghdr) {
+        .msg_name = to,
+        .msg_namelen = tolen,
+        .msg_iov = &io->out_iov[nout],
+        .msg_iovlen = 1,
+    };
+    return nout + 1;
+}
+
+/* sendmmsg stops at the first failure; skip that datagram as sendto would have */
+static void send_out(struct worker *w, struct batch_io *io, int nout) {
+    struct server_metrics *m = w->metrics;
+    for (int i = 0; i < nout;) {
+        int sent = sendmmsg(w->fd, io->out + i, nout - i, 0);
+        if (sent <= 0) {
+            i++;
+            continue;
         }
+        for (int j = i; j < i + sent; j++) {
+            metric_add(&m->responses, 1);
+            metric_add(&m->bytes_out, io->out[j].msg_len);
+        }
+        i += sent;
     }
-    return NULL;
 }
 
-void orchestrate_server_protocol(int sockfd, int drop_rate, int condensed) {
-    srand(time(NULL));
+/*
+ * Drain up to batch datagrams with one recvmmsg, answer them in order into
+ * one array and send every answer with one sendmmsg. Responses the
+ * impairments delay wait in the worker's timer queue; while any do, the
+ * worker sleeps only until the first is due and then sends what is due.
+ */
+static void orchestrate_server_protocol(struct worker *w) {
+    struct server_metrics *m = w->metrics;
+    int batch = w->args->batch;
+    int condensed = w->args->condensed;
+    struct batch_io *io = calloc(1, sizeof(*io));
+    if (!io) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < batch; i++) {
+        io->in_iov[i] = (struct iovec) { io->bufs[i], sizeof(io->bufs[i]) };
+        io->in[i].msg_hdr.msg_iov = &io->in_iov[i];
+        io->in[i].msg_hdr.msg_iovlen = 1;
+        io->in[i].msg_hdr.msg_name = &io->addrs[i];
+        if (w->args->kernel_ts) io->in[i].msg_hdr.msg_control = io->control[i].buf;
+    }
     while (1) {
-        uint8_t buf[64];
-        struct sockaddr_in cli;
-        socklen_t len = sizeof(cli);
-        ssize_t n = recvfrom(sockfd, buf, sizeof(buf), 0, (SA *) &cli, &len);
-        if (n <= 0) continue;
-        if ((rand() % 100) < drop_rate) continue;
-        uint32_t seq;
-        uint64_t c_sec, c_nsec;
-        if (condensed) {
-            if (n < (ssize_t) sizeof(struct condensed_request)) continue;
-            const struct condensed_request *r = (const struct condensed_request *) buf;
-            uint16_t ver = ntohs(r->ver_be);
-            if (ver != VERSION) continue;
-            seq = ntohl(r->seq_be);
-            c_sec = be64toh(r->c_sec_be);
-            c_nsec = be64toh(r->c_nsec_be);
-        } else {
-            if (n < 24) continue;
-            seq = get_u32(buf);
-            uint32_t ver = get_u32(buf + 4);
-            if (ver != VERSION) continue;
-            c_sec = get_u64(buf + 8);
-            c_nsec = get_u64(buf + 16);
-        }
-        struct client_state *slot = get_client_slot(&cli);
-        if (slot) {
-            time_t now = time(NULL);
-            if (now - slot->last_update > TWO_MINUTES) slot->max_seq = 0;
-            if (slot->max_seq && seq < slot->max_seq) {
-                char ip[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &cli.sin_addr, ip, sizeof(ip));
-                printf("%s:%u %u %u\n", ip, ntohs(cli.sin_port), seq, slot->max_seq);
-                fflush(stdout);
+        for (int i = 0; i < batch; i++) {
+            io->in[i].msg_hdr.msg_namelen = sizeof(io->addrs[i]);
+            if (w->args->kernel_ts) io->in[i].msg_hdr.msg_controllen = sizeof(io->control[i].buf);
+        }
+        int flags = MSG_WAITFORONE;
+        int64_t due = impair_next_due(&w->impair);
+        if (due >= 0) {
+            int64_t left = due - now_ns();
+            if (left > 0) {
+                struct timespec ts = { left / 1000000000, left % 1000000000 };
+                struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+                ppoll(&pfd, 1, &ts, NULL);
             }
-            if (seq > slot->max_seq) {
-                slot->max_seq = seq;
-                slot->last_update = now;
+            flags = MSG_DONTWAIT;
+        }
+        int n = recvmmsg(w->fd, io->in, batch, flags, NULL);
+        if (n <= 0 && due < 0) continue;
+        int64_t start = now_ns();
+        int nout = 0;
+        if (n > 0) {
+            metric_observe(&m->batch_size, n);
+            client_table_expire(&w->clients, time(NULL));
+            /* Decode and encode the whole batch at once; see udp_proto.h */
+            decode_requests(io->bufs[0], sizeof(io->bufs[0]), n, condensed, io->reqs);
+            int nanswers = 0;
+            for (int i = 0; i < n; i++) {
+                if (io->in[i].msg_len == 0) continue;
+                struct timespec rx;
+                int stamped = w->args->kernel_ts && rx_timestamp(&io->in[i].msg_hdr, &rx);
+                if (handle_request(w, &io->reqs[i], io->in[i].msg_len, &io->addrs[i], stamped ? &rx : NULL,
+                                   &io->answers[nanswers])) {
+                    io->answered[nanswers++] = i;
+                }
+            }
+            encode_responses(io->answers, nanswers, condensed, io->resps[0], sizeof(io->resps[0]));
+            size_t len = response_len(condensed);
+            for (int j = 0; j < nanswers; j++) {
+                int i = io->answered[j];
+                int copies = impair_response(&w->impair, start, &io->addrs[i], io->resps[j], len);
+                for (int c = 0; c < copies; c++) {
+                    nout = add_out(io, nout, &io->addrs[i], io->in[i].msg_hdr.msg_namelen, io->resps[j], len);
+                }
             }
+            send_out(w, io, nout);
+            metric_set(&m->clients, w->clients.count);
+            metric_set(&m->expired, w->clients.expired);
+            int64_t elapsed = now_ns() - start;
+            for (int i = 0; i < nout; i++) metric_observe(&m->processing_ns, elapsed);
         }
-        struct timespec t = now_ts();
-        if (condensed) {
-            struct condensed_response resp;
-            resp.seq_be = htonl(seq);
-            resp.ver_be = htons((uint16_t) VERSION);
-            resp.c_sec_be = htobe64(c_sec);
-            resp.c_nsec_be = htobe64(c_nsec);
-            resp.s_sec_be = htobe64((uint64_t) t.tv_sec);
-            resp.s_nsec_be = htobe64((uint64_t) t.tv_nsec);
-            sendto(sockfd, &resp, sizeof(resp), 0, (SA *) &cli, len);
-        } else {
-            uint8_t resp[40];
-            put_u32(resp, seq);
-            put_u32(resp + 4, VERSION);
-            put_u64(resp + 8, c_sec);
-            put_u64(resp + 16, c_nsec);
-            put_u64(resp + 24, (uint64_t) t.tv_sec);
-            put_u64(resp + 32, (uint64_t) t.tv_nsec);
-            sendto(sockfd, resp, sizeof(resp), 0, (SA *) &cli, len);
+        /* Then whatever the timer queue has due, a batch at a time */
+        for (int k = MAX_BATCH; k == MAX_BATCH;) {
+            nout = 0;
+            for (k = 0; k < MAX_BATCH && impair_due(&w->impair, start, &io->released[k]); k++) {
+                struct held_datagram *d = &io->released[k];
+                nout = add_out(io, nout, &d->to, sizeof(d->to), d->data, d->len);
+            }
+            send_out(w, io, nout);
         }
+        metric_set(&m->duplicated, w->impair.duplicated);
+        metric_set(&m->reordered, w->impair.reordered);
+        metric_set(&m->held, w->impair.nheld);
     }
 }
 
-int main(int argc, char *argv[]) {
-    struct server_arguments args = server_parseopt(argc, argv);
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd == -1) {
+/* Sharing the port only among our own threads: a lone server still fails on a port already taken */
+static int open_socket(int port, int kernel_ts, int reuseport) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
         perror("socket");
         exit(1);
     }
+    int one = 1;
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(1);
+    }
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (kernel_ts && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0) {
+        perror("setsockopt(SO_TIMESTAMPING)");
+        exit(1);
+    }
     struct sockaddr_in serv = { 0 };
     serv.sin_family = AF_INET;
     serv.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv.sin_port = htons(args.port);
-    if (bind(sockfd, (SA *) &serv, sizeof(serv)) != 0) {
+    serv.sin_port = htons(port);
+    if (bind(fd, (SA *) &serv, sizeof(serv)) != 0) {
         perror("bind");
         exit(1);
     }
-    printf("Server ready on port %d (drop=%d%% condensed=%d)\n", args.port, args.drop_rate, args.condensed);
+    return fd;
+}
+
+/*
+ * Steer every datagram to the worker pinned to the CPU that received it,
+ * so the flows a NIC queue hashes to a CPU are served there too. Sockets
+ * in a reuseport group are numbered in bind order, which is worker order.
+ */
+static void steer_by_cpu(const struct worker *workers, int n) {
+    struct sock_filter code[2 * MAX_THREADS + 3];
+    int len = 0;
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < n; i++) {
+        if (workers[i].cpu < 0) continue;
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    /* A CPU without a worker of its own */
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+    struct sock_fprog prog = { .len = len, .filter = code };
+    if (setsockopt(workers[0].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        exit(1);
+    }
+}
+
+/*
+ * Order the CPUs we are allowed to run on so that the first hyperthread of
+ * every physical core comes before any sibling. Returns the number of CPUs.
+ */
+static int cpu_pin_order(int *order, int max) {
+    cpu_set_t set;
+    int n = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+            if (!CPU_ISSET(cpu, &set)) continue;
+            char path[96];
+            int first = cpu;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            FILE *f = fopen(path, "r");
+            if (f) {
+                if (fscanf(f, "%d", &first) != 1) first = cpu;
+                fclose(f);
+            }
+            if ((first == cpu) == (pass == 0)) order[n++] = cpu;
+        }
+    }
+    return n;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) fprintf(stderr, "worker %d: cannot pin to CPU %d: %s\n", w->id, w->cpu, strerror(err));
+    }
+    orchestrate_server_protocol(w);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    struct server_arguments args = server_parseopt(argc, argv);
+    int nthreads = args.threads;
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    /* One cache-line aligned block per worker, so counting never shares a line */
+    struct server_metrics *metrics = aligned_alloc(_Alignof(struct server_metrics), nthreads * sizeof(*metrics));
+    struct event_ring *events = aligned_alloc(_Alignof(struct event_ring), nthreads * sizeof(*events));
+    if (!workers || !metrics || !events) {
+        perror("calloc");
+        exit(1);
+    }
+    memset(metrics, 0, nthreads * sizeof(*metrics));
+    memset(events, 0, nthreads * sizeof(*events));
+    time_t now = time(NULL);
+    uint64_t seed = args.have_seed ? args.seed : (uint64_t) now_ns() ^ (uint64_t) getpid() << 32;
+    for (int i = 0; i < nthreads; i++) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        w->cpu = -1;
+        impair_init(&w->impair, &args.impair, seed + (uint64_t) i);
+        w->args = &args;
+        w->metrics = &metrics[i];
+        w->events = &events[i];
+        w->fd = open_socket(args.port, args.kernel_ts, nthreads > 1);
+        if (client_table_init(&w->clients, TWO_MINUTES, now) < 0) {
+            perror("client_table_init");
+            exit(1);
+        }
+    }
+    if (args.pin) {
+        int order[CPU_SETSIZE];
+        int ncpus = cpu_pin_order(order, CPU_SETSIZE);
+        for (int i = 0; i < nthreads && ncpus > 0; i++) {
+            workers[i].cpu = order[i % ncpus];
+        }
+        if (nthreads > ncpus) {
+            fprintf(stderr, "warning: %d threads but only %d usable CPUs\n", nthreads, ncpus);
+        }
+    }
+    if (args.steer_cpu && nthreads > 1) steer_by_cpu(workers, nthreads);
+    struct metrics_registry registry = {
+        .prefix = "udp_server",
+        .descs = server_metric_descs,
+        .ndescs = sizeof(server_metric_descs) / sizeof(server_metric_descs[0]),
+        .blocks = metrics,
+        .stride = sizeof(*metrics),
+        .nthreads = nthreads,
+    };
+    metrics_start(&registry, args.stats_port, args.stats_interval);
+    printf("Server ready on port %d (drop=%g%% condensed=%d batch=%d threads=%d kernel-ts=%d seed=%llu)\n", args.port,
+           args.impair.drop * 100, args.condensed, args.batch, nthreads, args.kernel_ts, (unsigned long long) seed);
     fflush(stdout);
-    orchestrate_server_protocol(sockfd, args.drop_rate, args.condensed);
-    close(sockfd);
+    FILE *event_out = stdout;
+    if (args.event_log) {
+        event_out = fopen(args.event_log, "wb");
+        if (!event_out) {
+            perror(args.event_log);
+            exit(1);
+        }
+    }
+    event_log_start(events, nthreads, event_out, args.event_log != NULL);
+    for (int i = 1; i < nthreads; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    worker_main(&workers[0]);
     return 0;
 }